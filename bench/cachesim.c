@@ -0,0 +1,151 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdint.h>
+
+#include "cachesim.h"
+
+/* this file must not be compiled with -fsanitize=thread itself */
+
+#define LINE_BITS 6
+
+struct cache {
+	unsigned int sets;
+	unsigned int ways;
+	/* tags of the lines of every set, the most recently used one first */
+	uint64_t * tags;
+	uint64_t misses;
+};
+
+static uint64_t l1_tags[64 * 8];
+static uint64_t l2_tags[1024 * 16];
+static struct cache levels[2] = {
+	{ 64, 8, l1_tags, 0 },
+	{ 1024, 16, l2_tags, 0 },
+};
+static uint64_t accesses;
+
+/* function that looks up a line in a cache and makes it the most recently
+ * used one of its set, returns 1 on a hit and 0 on a miss, which loads it */
+static int lookup(struct cache * c, const uint64_t line) {
+	/* tag 0 marks an empty way, so lines are stored plus one */
+	uint64_t tag = line + 1;
+	uint64_t * set = &c->tags[(line % c->sets) * c->ways];
+	unsigned int i;
+	for (i = 0; i < c->ways - 1 && set[i] != tag; i++);
+	int hit = (set[i] == tag);
+	for (; i > 0; i--) set[i] = set[i - 1];
+	set[0] = tag;
+	if (!hit) c->misses++;
+	return hit;
+}
+
+/* function that accesses the lines of size bytes at an address */
+static void access_range(const void * addr, const uint64_t size) {
+	if (size == 0) return;
+	uint64_t line = (uintptr_t) addr >> LINE_BITS;
+	uint64_t last = ((uintptr_t) addr + size - 1) >> LINE_BITS;
+	for (; line <= last; line++) {
+		accesses++;
+		if (!lookup(&levels[CACHESIM_L1], line)) lookup(&levels[CACHESIM_L2], line);
+	}
+}
+
+/* function that returns the misses of a cache level so far */
+uint64_t cachesim_misses(const int level) {
+	return levels[level].misses;
+}
+
+/* function that returns the number of line accesses so far */
+uint64_t cachesim_accesses() {
+	return accesses;
+}
+
+/* the functions called by code compiled with -fsanitize=thread */
+
+void __tsan_init() {
+}
+
+void __tsan_func_entry(void * pc __attribute__ ((unused))) {
+}
+
+void __tsan_func_exit() {
+}
+
+#define ACCESS(size) \
+	void __tsan_read##size(void * addr) { access_range(addr, size); } \
+	void __tsan_write##size(void * addr) { access_range(addr, size); } \
+	void __tsan_unaligned_read##size(void * addr) { access_range(addr, size); } \
+	void __tsan_unaligned_write##size(void * addr) { access_range(addr, size); }
+ACCESS(1)
+ACCESS(2)
+ACCESS(4)
+ACCESS(8)
+ACCESS(16)
+
+void __tsan_read_range(void * addr, unsigned long size) {
+	access_range(addr, size);
+}
+
+void __tsan_write_range(void * addr, unsigned long size) {
+	access_range(addr, size);
+}
+
+/* atomic operations are done with the builtins, which aren't instrumented here */
+#define ATOMIC(bits) \
+	typedef int##bits##_t a##bits; \
+	a##bits __tsan_atomic##bits##_load(const volatile a##bits * a, int mo __attribute__ ((unused))) { \
+		access_range((const void *) a, sizeof(*a)); return __atomic_load_n(a, __ATOMIC_SEQ_CST); } \
+	void __tsan_atomic##bits##_store(volatile a##bits * a, a##bits v, int mo __attribute__ ((unused))) { \
+		access_range((const void *) a, sizeof(*a)); __atomic_store_n(a, v, __ATOMIC_SEQ_CST); } \
+	a##bits __tsan_atomic##bits##_exchange(volatile a##bits * a, a##bits v, int mo __attribute__ ((unused))) { \
+		access_range((const void *) a, sizeof(*a)); return __atomic_exchange_n(a, v, __ATOMIC_SEQ_CST); } \
+	a##bits __tsan_atomic##bits##_fetch_add(volatile a##bits * a, a##bits v, int mo __attribute__ ((unused))) { \
+		access_range((const void *) a, sizeof(*a)); return __atomic_fetch_add(a, v, __ATOMIC_SEQ_CST); } \
+	a##bits __tsan_atomic##bits##_fetch_sub(volatile a##bits * a, a##bits v, int mo __attribute__ ((unused))) { \
+		access_range((const void *) a, sizeof(*a)); return __atomic_fetch_sub(a, v, __ATOMIC_SEQ_CST); } \
+	a##bits __tsan_atomic##bits##_fetch_and(volatile a##bits * a, a##bits v, int mo __attribute__ ((unused))) { \
+		access_range((const void *) a, sizeof(*a)); return __atomic_fetch_and(a, v, __ATOMIC_SEQ_CST); } \
+	a##bits __tsan_atomic##bits##_fetch_or(volatile a##bits * a, a##bits v, int mo __attribute__ ((unused))) { \
+		access_range((const void *) a, sizeof(*a)); return __atomic_fetch_or(a, v, __ATOMIC_SEQ_CST); } \
+	a##bits __tsan_atomic##bits##_fetch_xor(volatile a##bits * a, a##bits v, int mo __attribute__ ((unused))) { \
+		access_range((const void *) a, sizeof(*a)); return __atomic_fetch_xor(a, v, __ATOMIC_SEQ_CST); } \
+	int __tsan_atomic##bits##_compare_exchange_strong(volatile a##bits * a, a##bits * c, a##bits v, \
+			int mo __attribute__ ((unused)), int fmo __attribute__ ((unused))) { \
+		access_range((const void *) a, sizeof(*a)); \
+		return __atomic_compare_exchange_n(a, c, v, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); } \
+	int __tsan_atomic##bits##_compare_exchange_weak(volatile a##bits * a, a##bits * c, a##bits v, \
+			int mo __attribute__ ((unused)), int fmo __attribute__ ((unused))) { \
+		access_range((const void *) a, sizeof(*a)); \
+		return __atomic_compare_exchange_n(a, c, v, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); } \
+	a##bits __tsan_atomic##bits##_compare_exchange_val(volatile a##bits * a, a##bits c, a##bits v, \
+			int mo __attribute__ ((unused)), int fmo __attribute__ ((unused))) { \
+		access_range((const void *) a, sizeof(*a)); \
+		__atomic_compare_exchange_n(a, &c, v, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); return c; }
+ATOMIC(8)
+ATOMIC(16)
+ATOMIC(32)
+ATOMIC(64)
+
+void __tsan_atomic_thread_fence(int mo __attribute__ ((unused))) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void __tsan_atomic_signal_fence(int mo __attribute__ ((unused))) {
+}
@@ -0,0 +1,41 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef CACHESIM_H
+#define CACHESIM_H
+
+#include <stdint.h>
+
+/*
+ * A model of the data caches, for machines without a cache miss counter, e.g.
+ * virtual machines. The code to measure is compiled with -fsanitize=thread,
+ * which calls a function for every memory access. cachesim.c provides these
+ * functions instead of the thread sanitizer's runtime, and feeds the
+ * addresses into two levels of set-associative caches with LRU replacement:
+ * a L1 of 32 KiB, 8-way, and a L2 of 1 MiB, 16-way, both with 64 byte lines.
+ * Stack accesses count too, as in hardware.
+ */
+
+#define CACHESIM_L1 0
+#define CACHESIM_L2 1
+
+uint64_t cachesim_misses(const int level);
+uint64_t cachesim_accesses();
+
+#endif /* CACHESIM_H */
@@ -0,0 +1,171 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Throughput of forwarded ports over loopback, for the proxy backend. Maps a
+ * private port at the daemon on 127.0.0.1, receives on the private port in a
+ * child and sends to the public port of the answer. TCP sends a fixed amount
+ * of data, UDP a fixed number of small datagrams, of which the ones lost are
+ * counted.
+ */
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../natpmp_defs.h"
+
+#define TCP_BYTES (2L << 30)
+#define UDP_DATAGRAMS 1000000
+#define UDP_SIZE 64
+
+static char buf[1 << 16];
+
+/* function that returns the time in seconds */
+double seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* function that returns a loopback address with a port in host byte order */
+struct sockaddr_in loopback(const uint16_t port) {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	return addr;
+}
+
+/* function that maps a private port of the protocol, returns the public port
+ * in host byte order */
+uint16_t map(const uint8_t protocol, const uint16_t private_port) {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in addr = loopback(0);
+	addr.sin_port = NATPMP_PORT;
+	struct timeval tv = { 2, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	natpmp_packet_map_request request;
+	natpmp_packet_map_answer answer;
+	memset(&request, 0, sizeof(request));
+	request.header.op = protocol;
+	request.mapping.private_port = htons(private_port);
+	request.mapping.public_port = htons(private_port);
+	request.mapping.lifetime = htonl(3600);
+	sendto(fd, &request, sizeof(request), 0, (struct sockaddr *) &addr, sizeof(addr));
+	if (recv(fd, &answer, sizeof(answer), 0) != sizeof(answer) || answer.answer.result != NATPMP_SUCCESS) {
+		fprintf(stderr, "Mapping private port %hu failed\n", private_port);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	return ntohs(answer.mapping.public_port);
+}
+
+/* function that sends TCP_BYTES through the public port */
+void bench_tcp(const uint16_t private_port) {
+	struct sockaddr_in addr = loopback(private_port);
+	int one = 1;
+	int lfd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(lfd, 1) == -1) {
+		perror("bind");
+		exit(EXIT_FAILURE);
+	}
+	addr = loopback(map(NATPMP_MAP_TCP, private_port));
+
+	if (fork() == 0) {
+		int cfd = accept(lfd, NULL, NULL);
+		long received = 0, r;
+		while ((r = read(cfd, buf, sizeof(buf))) > 0) received += r;
+		exit((received == TCP_BYTES) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	close(lfd);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		perror("connect");
+		exit(EXIT_FAILURE);
+	}
+	double t = seconds();
+	long sent = 0, w;
+	while (sent < TCP_BYTES && (w = write(fd, buf, (TCP_BYTES - sent < (long) sizeof(buf)) ? TCP_BYTES - sent : (long) sizeof(buf))) > 0)
+		sent += w;
+	close(fd);
+	int status;
+	wait(&status);
+	t = seconds() - t;
+	printf("tcp: %ld bytes in %.3f s: %.1f MB/s%s\n", sent, t, sent / 1e6 / t,
+			(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) ? "" : ", not all received");
+}
+
+/* function that sends UDP_DATAGRAMS through the public port */
+void bench_udp(const uint16_t private_port) {
+	struct sockaddr_in addr = loopback(private_port);
+	int rfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (bind(rfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		perror("bind");
+		exit(EXIT_FAILURE);
+	}
+	int size = 8 << 20;
+	setsockopt(rfd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size));
+	struct timeval tv = { 0, 300000 };
+	setsockopt(rfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	addr = loopback(map(NATPMP_MAP_UDP, private_port));
+
+	if (fork() == 0) {
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
+		connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+		int i;
+		for (i = 0; i < UDP_DATAGRAMS; i++) {
+			send(fd, buf, UDP_SIZE, 0);
+			/* let the forwarding keep up a bit */
+			if (i % 64 == 0) sched_yield();
+		}
+		exit(EXIT_SUCCESS);
+	}
+
+	long received = 0;
+	double t = seconds(), last = t;
+	while (recv(rfd, buf, sizeof(buf), 0) > 0) {
+		received++;
+		last = seconds();
+	}
+	wait(NULL);
+	printf("udp: %ld of %d datagrams of %d bytes in %.3f s: %.0f kpps\n", received, UDP_DATAGRAMS, UDP_SIZE,
+			last - t, received / 1e3 / (last - t));
+}
+
+int main(int argc, char ** argv) {
+	if (argc != 3 || (strcmp(argv[1], "tcp") != 0 && strcmp(argv[1], "udp") != 0)) {
+		fprintf(stderr, "Usage: %s tcp|udp private-port\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	uint16_t private_port = strtoul(argv[2], NULL, 10);
+	if (argv[1][0] == 't') bench_tcp(private_port);
+	else bench_udp(private_port);
+	return EXIT_SUCCESS;
+}
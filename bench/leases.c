@@ -0,0 +1,207 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Benchmark of the lease table: lookups by client and private port and
+ * renewals, which update the expires heap too, for growing tables,
+ * and the full scan and the expiry sweep for the largest one. Every lease
+ * occupies a public port, so a table never holds more than 65535 leases.
+ * Cache misses are counted with perf_event_open() if the kernel allows it.
+ * bench/leases-cachesim runs it on a model of the caches instead, see
+ * cachesim.h, and reports the misses of both levels without times.
+ */
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../leases.h"
+#include "../natpmp_defs.h"
+#ifdef CACHESIM
+#include "cachesim.h"
+#endif
+
+#define RENEWALS 2000000
+#define SCANS 200
+
+int debuglevel = 0;
+int do_fork = 0;
+
+/* the cache miss counter, -1 if not available */
+int misses_fd = -1;
+
+/* function that opens the cache miss counter of the calling thread */
+void misses_open() {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	misses_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* function that returns the cache misses counted so far, 0 without counter */
+uint64_t misses() {
+	uint64_t count = 0;
+	if (misses_fd != -1 && read(misses_fd, &count, sizeof(count)) != sizeof(count)) count = 0;
+	return count;
+}
+
+/* function that returns the time in seconds */
+double seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the time and the cache misses at the start of a measurement */
+struct sample {
+	double t;
+	uint64_t m;
+#ifdef CACHESIM
+	uint64_t l1;
+	uint64_t l2;
+#endif
+};
+
+/* function that starts a measurement */
+struct sample start() {
+	struct sample s;
+	s.t = seconds();
+	s.m = misses();
+#ifdef CACHESIM
+	s.l1 = cachesim_misses(CACHESIM_L1);
+	s.l2 = cachesim_misses(CACHESIM_L2);
+#endif
+	return s;
+}
+
+/* function that prints the time and the cache misses per operation since the sample s */
+void report(const uint32_t count, const char * op, const uint64_t ops, const struct sample s) {
+#ifdef CACHESIM
+	/* the model makes the times meaningless */
+	printf("%6u leases: %8.2f L1 misses, %8.2f L2 misses per %s\n", count,
+			(double) (cachesim_misses(CACHESIM_L1) - s.l1) / ops, (double) (cachesim_misses(CACHESIM_L2) - s.l2) / ops, op);
+#else
+	printf("%6u leases: %10.1f ns", count, (seconds() - s.t) / ops * 1e9);
+	if (misses_fd != -1) printf(", %8.2f cache misses", (double) (misses() - s.m) / ops);
+	printf(" per %s\n", op);
+#endif
+}
+
+/* the client and the private port of lease i */
+uint32_t client_of(const uint32_t i) {
+	return htonl(0x0a000000 + i / 16);
+}
+uint16_t private_port_of(const uint32_t i) {
+	return htons(1000 + i % 16);
+}
+
+/* function that fills a table with count leases, removes and adds a part of
+ * them again so they don't lie in the order of creation, then times renewals */
+void bench_renewals(const uint32_t count) {
+	uint32_t i;
+	uint64_t j;
+	lease_t a;
+
+	leases_init(count, count);
+	for (i = 0; i < count; i++) {
+		a = add_lease(client_of(i), private_port_of(i), htons(i + 1));
+		set_lease_expires(a, NATPMP_MAP_UDP, 1000 + rand() % 100000);
+	}
+	for (j = 0; j < count / 2; j++) {
+		i = rand() % count;
+		a = get_lease_by_client_port(client_of(i), private_port_of(i));
+		uint32_t expires = leases.expires[NATPMP_MAP_UDP][a];
+		uint16_t public_port = leases.public_port[a];
+		remove_lease(a);
+		a = add_lease(client_of(i), private_port_of(i), public_port);
+		set_lease_expires(a, NATPMP_MAP_UDP, expires);
+	}
+
+	volatile lease_t found;
+	struct sample s = start();
+	for (j = 0; j < RENEWALS; j++) {
+		i = (uint32_t) (j * 7919 % count);
+		found = get_lease_by_client_port(client_of(i), private_port_of(i));
+	}
+	report(count, "lookup", RENEWALS, s);
+
+	s = start();
+	for (j = 0; j < RENEWALS; j++) {
+		i = (uint32_t) (j * 7919 % count);
+		a = get_lease_by_client_port(client_of(i), private_port_of(i));
+		set_lease_expires(a, NATPMP_MAP_UDP, leases.expires[NATPMP_MAP_UDP][a] + 1);
+	}
+	report(count, "renewal", RENEWALS, s);
+	(void) found;
+}
+
+/* function that times full scans and the expiry sweep of the table filled by
+ * bench_renewals() */
+void bench_scans(const uint32_t count) {
+	volatile uint64_t sum = 0;
+	uint32_t pass;
+	lease_t a;
+
+	struct sample s = start();
+	for (pass = 0; pass < SCANS; pass++) {
+		a = NO_LEASE;
+		while ((a = get_next_lease(a)) != NO_LEASE) sum += leases.expires[NATPMP_MAP_UDP][a] + leases.public_port[a];
+	}
+	report(count, "full scan", SCANS, s);
+
+	uint32_t now = 1000;
+	uint64_t expired = 0;
+	s = start();
+	while (now < 200000) {
+		now += 1000;
+		while ((a = get_next_expired_lease(now)) != NO_LEASE) {
+			set_lease_expires(a, NATPMP_MAP_UDP, now + 50000);
+			expired++;
+		}
+	}
+	report(count, "expired lease", expired, s);
+}
+
+int main(int argc, char ** argv) {
+	uint32_t sizes[] = { 100, 1000, 10000, 65535 };
+	unsigned int i;
+
+	(void) argc;
+	(void) argv;
+	srand(1);
+#ifndef CACHESIM
+	misses_open();
+	if (misses_fd == -1) printf("Cache misses can't be counted here, bench/leases-cachesim models them.\n");
+#endif
+	for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		bench_renewals(sizes[i]);
+		if (i == sizeof(sizes) / sizeof(*sizes) - 1) bench_scans(sizes[i]);
+		leases_free();
+	}
+	return EXIT_SUCCESS;
+}
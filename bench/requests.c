@@ -0,0 +1,101 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Load generator for map requests to a daemon on 127.0.0.1, keeps a window of
+ * requests in flight and reports the answers per second. The requests cycle
+ * through private-ports private ports, so a count larger than that renews the
+ * same leases again, all of them ask for the same public port.
+ */
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../natpmp_defs.h"
+
+#define WINDOW 64
+
+/* function that returns the time in seconds */
+double seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char ** argv) {
+	if (argc < 2 || argc > 5) {
+		fprintf(stderr, "Usage: %s count [private-ports [lifetime [public-port]]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	uint32_t count = strtoul(argv[1], NULL, 10);
+	uint32_t private_ports = (argc > 2) ? strtoul(argv[2], NULL, 10) : count;
+	uint32_t lifetime = (argc > 3) ? strtoul(argv[3], NULL, 10) : 3600;
+	uint16_t public_port = (argc > 4) ? strtoul(argv[4], NULL, 10) : 20000;
+	if (count == 0 || private_ports == 0 || private_ports > 50000) {
+		fprintf(stderr, "%s: count and private-ports must be 1 or more, private-ports at most 50000\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		perror("socket");
+		return EXIT_FAILURE;
+	}
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = NATPMP_PORT;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	struct timeval tv = { 2, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	int size = 1 << 22;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	natpmp_packet_map_request request;
+	natpmp_packet_map_answer answer;
+	request.header.version = 0;
+	request.header.op = NATPMP_MAP_UDP;
+	request._reserved = 0;
+	request.mapping.public_port = htons(public_port);
+	request.mapping.lifetime = htonl(lifetime);
+
+	uint32_t sent = 0, received = 0, failed = 0;
+	double t = seconds();
+	while (received < count) {
+		while (sent < count && sent - received < WINDOW) {
+			request.mapping.private_port = htons(10000 + sent % private_ports);
+			sendto(fd, &request, sizeof(request), 0, (struct sockaddr *) &addr, sizeof(addr));
+			sent++;
+		}
+		if (recv(fd, &answer, sizeof(answer), 0) <= 0) {
+			fprintf(stderr, "No answer after %u of %u answers\n", received, count);
+			return EXIT_FAILURE;
+		}
+		if (answer.answer.result != NATPMP_SUCCESS) failed++;
+		received++;
+	}
+	t = seconds() - t;
+	printf("%u requests for %u private ports in %.3f s: %.0f answers/s, %u not successful\n",
+			count, private_ports, t, count / t, failed);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,67 @@
+#!/bin/bash
+#
+#    natpmp - an implementation of NAT-PMP
+#    Copyright (C) 2007-2008  Adrian Friedli
+#
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License along
+#   with this program; if not, write to the Free Software Foundation, Inc.,
+#   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+
+# Builds natpmp and the benchmarks and runs them against a daemon on lo, with
+# the dummy backend for the requests and the proxy backend for forwarding. The
+# daemon needs the port 5351 on 127.0.0.1, so run it as root or in a network
+# namespace of its own, like: unshare -Urn bench/run.sh
+# Extra options for the daemon can be given in NATPMP_ARGS, for example -w 4.
+
+cd "$(dirname "$0")/.." || exit 1
+make -s clean
+make -s CFLAGS=-O2 all bench || exit 1
+ip link set lo up 2>/dev/null
+
+PID=
+function start () {
+# the dummy backend prints every rule change
+./natpmp -q -i lo -a 127.0.0.1 -B $1 $NATPMP_ARGS > /dev/null &
+PID=$!
+sleep 0.3
+}
+
+function stop () {
+kill $PID
+wait $PID 2>/dev/null
+}
+
+echo "== lease table"
+bench/leases
+
+echo "== lease table on a model of the caches, takes a while"
+bench/leases-cachesim
+
+echo "== map requests, dummy backend"
+start dummy
+# new leases, all asking for the same public port
+bench/requests 50000 50000
+# renewals of those leases
+bench/requests 200000 50000
+# retransmissions, answered from the cache
+bench/requests 200000 1
+stop
+
+echo "== forwarding over loopback, proxy backend"
+start proxy
+bench/forward tcp 5000
+bench/forward udp 5001
+stop
+
+make -s clean
@@ -0,0 +1,50 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string.h>
+
+#include "dnat_api.h"
+
+/* all backends, the first one is the default */
+static const struct dnat_backend * const backends[] = {
+	&linux_iptables_backend,
+	&linux_nftables_backend,
+	&linux_proxy_backend,
+	&dnat_dummy_backend,
+};
+
+const struct dnat_backend * dnat = &linux_iptables_backend;
+
+/* return the backend with the given name, NULL if there is none */
+const struct dnat_backend * find_dnat_backend(const char * name) {
+	size_t i;
+	for (i = 0; i < sizeof(backends) / sizeof(*backends); i++) {
+		if (strcmp(backends[i]->name, name) == 0) return backends[i];
+	}
+	return NULL;
+}
+
+/* print the names of all backends */
+void print_dnat_backends(FILE * f) {
+	size_t i;
+	for (i = 0; i < sizeof(backends) / sizeof(*backends); i++) {
+		fprintf(f, "%s%s", (i) ? ", " : "", backends[i]->name);
+	}
+	fprintf(f, "\n");
+}
@@ -21,35 +21,77 @@
 #define DNAT_API_H
 
 #include <stdint.h>
+#include <stdio.h>
 
 /*
  * IP addresses and port numbers all are in network byte order!
- * create_dnat_rule() and destroy_dnat_rule() must succeed if rule was already
- * there respectively has already gone.
+ * create_rule() and destroy_rule() must succeed if rule was already there
+ * respectively has already gone.
  * Port numbers in a rule with a port range must be considered as existing but
- * must not get destroyed, destroy_dnat_rule() must return 1 if requested to do
- * so. Do the same, if the program recognizes that the given rule was not
- * created by itself, e.g. if the rule is in chain not used by the program. But
- * only do this, if the underlying system provides such information.
+ * must not get destroyed, destroy_rule() must return 1 if requested to do so.
+ * Do the same, if the program recognizes that the given rule was not created
+ * by itself, e.g. if the rule is in chain not used by the program. But only do
+ * this, if the underlying system provides such information.
+ * Changes are made in transactions: begin() gets called before a batch of
+ * changes and commit() after it. Backends may queue the changes of
+ * create_rule() and destroy_rule() until commit() and should apply them
+ * together. A rule which could not be created is dropped by the daemon and
+ * the client gets told so. All functions get called by the helper process
+ * only. get_rule_by_public_port(), get_rule_by_client_port() and list_ports()
+ * get called by a thread of their own and may run while commit() does, but not
+ * while any other function runs.
  */
 
 /* valid values for protocol */
 #define UDP 1
 #define TCP 2
 
-/* function that gets called on starting, only options specific for the backend get passed e.g. for storing the name of the iptables chain */
-void dnat_init(int argc, char * argv[]);
+struct dnat_backend {
+	/* name of the backend on the command line */
+	const char * name;
 
-/* search DNAT rule for given public port, return 1 if found, 0 if not found and -1 on error, set client and private_port if not NULL */
-int get_dnat_rule_by_public_port(const char protocol, const uint16_t public_port, uint32_t * client, uint16_t * private_port);
+	/* function that gets called on starting, only options specific for the backend get passed e.g. for storing the name of the iptables chain */
+	void (*init)(int argc, char * argv[]);
 
-/* search DNAT rule for given private port and client, return 1 if found, 0 if not found and -1 on error, set public_port if not NULL */
-int get_dnat_rule_by_client_port(const char protocol, uint16_t * public_port, const uint32_t client, const uint16_t private_port);
+	/* search DNAT rule for given public port, return 1 if found, 0 if not found and -1 on error, set client and private_port if not NULL */
+	int (*get_rule_by_public_port)(const char protocol, const uint16_t public_port, uint32_t * client, uint16_t * private_port);
 
-/* create a DNAT rule with given public port, client ip address and private port, return 0 on success and -1 on failure */
-int create_dnat_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port);
+	/* search DNAT rule for given private port and client, return 1 if found, 0 if not found and -1 on error, set public_port if not NULL */
+	int (*get_rule_by_client_port)(const char protocol, uint16_t * public_port, const uint32_t client, const uint16_t private_port);
 
-/* destroy a DNAT rule with given public port, client ip address and private port, return 0 on success, 1 when forbidden and -1 on failure */
-int destroy_dnat_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port);
+	/* start a transaction, return 0 on success and -1 on failure */
+	int (*begin)();
+
+	/* create a DNAT rule with given public port, client ip address and private port, return 0 on success and -1 on failure */
+	int (*create_rule)(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port);
+
+	/* destroy a DNAT rule with given public port, client ip address and private port, return 0 on success, 1 when forbidden and -1 on failure */
+	int (*destroy_rule)(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port);
+
+	/* apply all changes since begin(), return 0 on success and -1 on failure, on failure call failed() with the number of every change
+	 * not applied, counting the calls of create_rule() and destroy_rule() since begin() from 0, without a call all changes count as failed */
+	int (*commit)(void (*failed)(const uint32_t change));
+
+	/* function that gets called on SIGHUP, backends keeping a copy of the rules read them again */
+	void (*reload)();
+
+	/* call found() for every DNAT rule created by this program, return 0 on success and -1 on failure */
+	int (*list_rules)(void (*found)(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port));
+
+	/* call taken() for the public ports of every DNAT rule, also of the ones not created by this program, these are the ports
+	 * get_rule_by_public_port() finds a rule for, return 0 on success and -1 on failure, may run while commit() does */
+	int (*list_ports)(void (*taken)(const char protocol, const uint16_t port_low, const uint16_t port_high));
+};
+
+extern const struct dnat_backend linux_iptables_backend;
+extern const struct dnat_backend linux_nftables_backend;
+extern const struct dnat_backend linux_proxy_backend;
+extern const struct dnat_backend dnat_dummy_backend;
+
+/* the backend in use */
+extern const struct dnat_backend * dnat;
+
+const struct dnat_backend * find_dnat_backend(const char * name);
+void print_dnat_backends(FILE * f);
 
 #endif /* DNAT_API_H */
@@ -23,7 +23,7 @@
 
 #include "dnat_api.h"
 
-void dnat_init(int argc, char * argv[]) {
+static void dnat_init(int argc, char * argv[]) {
 	printf("dnat_init(%d, {", argc);
 	int i;
 	for (i=0; i<argc; i++) {
@@ -33,28 +33,66 @@ void dnat_init(int argc, char * argv[]) {
 	printf("})\n");
 }
 
-int get_dnat_rule_by_public_port(const char protocol, const uint16_t public_port, uint32_t * client, uint16_t * private_port) {
+static int get_dnat_rule_by_public_port(const char protocol, const uint16_t public_port, uint32_t * client, uint16_t * private_port) {
 	printf("get_dnat_rule_by_public_port(%hhd, %hu, *, *)\n", protocol, ntohs(public_port));
 	if (client != NULL) *client = 0;
 	if (private_port != NULL) *private_port = 0;
 	return 0;
 }
 
-int get_dnat_rule_by_client_port(const char protocol, uint16_t * public_port, const uint32_t client, const uint16_t private_port) {
+static int get_dnat_rule_by_client_port(const char protocol, uint16_t * public_port, const uint32_t client, const uint16_t private_port) {
 	struct in_addr addr = {client};
 	printf("get_dnat_rule_by_client_port(%hhd, *, %s, %hu)\n", protocol, inet_ntoa(addr), ntohs(private_port));
 	if (public_port != NULL) *public_port = 0;
 	return 0;
 }
 
-int create_dnat_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+static int create_dnat_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
 	struct in_addr addr = {client};
 	printf("create_dnat_rule(%hhd, %hu, %s, %hu)\n", protocol, ntohs(public_port), inet_ntoa(addr), ntohs(private_port));
 	return 0;
 }
 
-int destroy_dnat_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+static int destroy_dnat_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
 	struct in_addr addr = {client};
 	printf("destroy_dnat_rule(%hhd, %hu, %s, %hu)\n", protocol, ntohs(public_port), inet_ntoa(addr), ntohs(private_port));
 	return 0;
 }
+
+static int dnat_commit(void (*failed)(const uint32_t change) __attribute__ ((unused))) {
+	printf("dnat_commit()\n");
+	return 0;
+}
+
+static void dnat_reload() {
+	printf("dnat_reload()\n");
+}
+
+static int list_dnat_rules(void (*found)(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) __attribute__ ((unused))) {
+	printf("list_dnat_rules(*)\n");
+	return 0;
+}
+
+static int dnat_begin() {
+	printf("dnat_begin()\n");
+	return 0;
+}
+
+static int list_dnat_ports(void (*taken)(const char protocol, const uint16_t port_low, const uint16_t port_high) __attribute__ ((unused))) {
+	printf("list_dnat_ports(*)\n");
+	return 0;
+}
+
+const struct dnat_backend dnat_dummy_backend = {
+	.name = "dummy",
+	.init = dnat_init,
+	.get_rule_by_public_port = get_dnat_rule_by_public_port,
+	.get_rule_by_client_port = get_dnat_rule_by_client_port,
+	.begin = dnat_begin,
+	.create_rule = create_dnat_rule,
+	.destroy_rule = destroy_dnat_rule,
+	.commit = dnat_commit,
+	.reload = dnat_reload,
+	.list_rules = list_dnat_rules,
+	.list_ports = list_dnat_ports,
+};
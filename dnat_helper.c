@@ -0,0 +1,348 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "die.h"
+#include "dnat_api.h"
+#include "dnat_helper.h"
+
+struct portmap rule_ports;
+
+/* sockets to the helper for changes and for lookups, or to the daemon in the helper */
+static int apply_fd = -1;
+static int lookup_fd = -1;
+/* the workers of the daemon take turns on the sockets */
+static pthread_mutex_t apply_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t lookup_lock = PTHREAD_MUTEX_INITIALIZER;
+/* in the helper, lookups get served by a thread of their own, the state of
+ * the backend is locked by both, except while commit() runs, which only
+ * excludes listing and reloading the rules */
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* function that sends a message, dies if the other process is gone */
+static void send_msg(const int fd, const void * data, const size_t len) {
+	while (send(fd, data, len, MSG_NOSIGNAL) == -1) {
+		if (errno != EINTR) p_die("send");
+	}
+}
+
+/* function that receives a message, returns its length, 0 if the other process is gone */
+static size_t recv_msg(const int fd, void * data, const size_t len) {
+	ssize_t ret;
+	while ((ret = recv(fd, data, len, 0)) == -1) {
+		if (errno != EINTR) p_die("recv");
+	}
+	return ret;
+}
+
+/* batch of changes being applied in the helper, with the record of every change passed to the backend */
+static struct helper_record batch[HELPER_BATCH_MAXSIZE];
+static size_t change_record[HELPER_BATCH_MAXSIZE];
+static uint32_t change_count;
+static int change_failures;
+
+/* function that marks a change the backend could not apply as failed */
+static void change_failed(const uint32_t change) {
+	if (change >= change_count) return;
+	batch[change_record[change]].result = -1;
+	change_failures++;
+}
+
+/* function that applies a batch of changes in the helper as one transaction */
+static void serve_apply() {
+	size_t count = recv_msg(apply_fd, batch, sizeof(batch)) / sizeof(*batch);
+	if (count == 0) exit(EXIT_SUCCESS);
+
+	size_t i;
+	pthread_mutex_lock(&commit_lock);
+	pthread_mutex_lock(&state_lock);
+	if (dnat->begin() == -1) {
+		pthread_mutex_unlock(&state_lock);
+		pthread_mutex_unlock(&commit_lock);
+		for (i = 0; i < count; i++) batch[i].result = -1;
+		send_msg(apply_fd, batch, count * sizeof(*batch));
+		return;
+	}
+	change_count = 0;
+	for (i = 0; i < count; i++) {
+		struct helper_record * r = &batch[i];
+		if (r->type == HELPER_CREATE) r->result = dnat->create_rule(r->protocol, r->public_port, r->client, r->private_port);
+		else if (r->type == HELPER_DESTROY) r->result = dnat->destroy_rule(r->protocol, r->public_port, r->client, r->private_port);
+		else {
+			r->result = -1;
+			continue;
+		}
+		change_record[change_count++] = i;
+	}
+	pthread_mutex_unlock(&state_lock);
+	change_failures = 0;
+	if (dnat->commit(change_failed) == -1 && change_failures == 0) {
+		/* the backend doesn't know which ones, none of the changes got applied */
+		for (i = 0; i < count; i++) {
+			if (batch[i].result == 0) batch[i].result = -1;
+		}
+	}
+	pthread_mutex_unlock(&commit_lock);
+
+	send_msg(apply_fd, batch, count * sizeof(*batch));
+}
+
+/* rules found by list_rules() in the helper, not sent yet */
+static struct helper_record list_batch[HELPER_BATCH_MAXSIZE];
+static size_t list_count;
+
+/* function that collects the rules found by list_rules(), as many as fit in a message at once */
+static void list_found(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	struct helper_record r = { HELPER_LIST, protocol, public_port, client, private_port, 0 };
+	list_batch[list_count++] = r;
+	if (list_count == HELPER_BATCH_MAXSIZE) {
+		send_msg(lookup_fd, list_batch, list_count * sizeof(*list_batch));
+		list_count = 0;
+	}
+}
+
+/* function that sends all rules of the backend in the helper */
+static void serve_list() {
+	list_count = 0;
+	int ret = dnat->list_rules(list_found);
+	struct helper_record end = { HELPER_LIST_END, 0, 0, 0, 0, ret };
+	list_batch[list_count++] = end;
+	send_msg(lookup_fd, list_batch, list_count * sizeof(*list_batch));
+}
+
+/* the ports of the rules being listed in the helper */
+static struct helper_ports list_ports;
+
+/* function that collects the ports of a rule found by list_ports() */
+static void ports_taken(const char protocol __attribute__ ((unused)), const uint16_t port_low, const uint16_t port_high) {
+	uint32_t port;
+	for (port = ntohs(port_low); port <= ntohs(port_high); port++) portmap_set(&list_ports.ports, port);
+}
+
+/* function that sends the ports of all rules of the backend in the helper */
+static void serve_list_ports() {
+	portmap_clear_all(&list_ports.ports);
+	list_ports.result = dnat->list_ports(ports_taken);
+	send_msg(lookup_fd, &list_ports, sizeof(list_ports));
+}
+
+/* function that answers a lookup in the helper */
+static void serve_lookup() {
+	struct helper_record r;
+	if (recv_msg(lookup_fd, &r, sizeof(r)) == 0) exit(EXIT_SUCCESS);
+
+	/* only searching rules may happen while a batch gets committed */
+	int searching = (r.type == HELPER_GET_BY_PUBLIC_PORT || r.type == HELPER_GET_BY_CLIENT_PORT || r.type == HELPER_LIST_PORTS);
+	if (!searching) pthread_mutex_lock(&commit_lock);
+	pthread_mutex_lock(&state_lock);
+	if (r.type == HELPER_LIST) serve_list();
+	else if (r.type == HELPER_LIST_PORTS) serve_list_ports();
+	else if (r.type == HELPER_GET_BY_PUBLIC_PORT) r.result = dnat->get_rule_by_public_port(r.protocol, r.public_port, &r.client, &r.private_port);
+	else if (r.type == HELPER_GET_BY_CLIENT_PORT) r.result = dnat->get_rule_by_client_port(r.protocol, &r.public_port, r.client, r.private_port);
+	else if (r.type == HELPER_RELOAD) {
+		dnat->reload();
+		r.result = 0;
+	}
+	else r.result = -1;
+	pthread_mutex_unlock(&state_lock);
+	if (!searching) pthread_mutex_unlock(&commit_lock);
+
+	if (r.type != HELPER_LIST && r.type != HELPER_LIST_PORTS) send_msg(lookup_fd, &r, sizeof(r));
+}
+
+/* function that runs in the lookup thread of the helper */
+static void * serve_lookups(void * arg __attribute__ ((unused))) {
+	while (42) serve_lookup();
+	return NULL;
+}
+
+/* main loop of the helper, applies the batches of changes, returns never */
+static void serve() {
+	/* signals are handled by the main thread only */
+	pthread_t thread;
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int err = pthread_create(&thread, NULL, serve_lookups, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		errno = err;
+		p_die("pthread_create");
+	}
+
+	while (42) serve_apply();
+}
+
+/* function that forks the helper and initializes the backend in it, must be
+ * called before opening any file descriptors the helper doesn't need */
+void helper_start(int argc, char * argv[]) {
+	int apply_pair[2], lookup_pair[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, apply_pair) == -1) p_die("socketpair");
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, lookup_pair) == -1) p_die("socketpair");
+
+	/* make sure to get told of failures in the backend's setup before going on */
+	int ready[2];
+	if (pipe(ready) == -1) p_die("pipe");
+
+	/* don't let the helper print what the daemon has not flushed yet */
+	fflush(stdout);
+	fflush(stderr);
+
+	pid_t child = fork();
+	if (child == -1) p_die("fork");
+	else if (child == 0) {
+		close(apply_pair[0]);
+		close(lookup_pair[0]);
+		close(ready[0]);
+		/* a hangup of the terminal is for the daemon, it asks for reloads itself */
+		signal(SIGHUP, SIG_IGN);
+		apply_fd = apply_pair[1];
+		lookup_fd = lookup_pair[1];
+		dnat->init(argc, argv);
+		close(ready[1]);
+		if (do_fork) {
+			chdir("/");
+			fclose(stdin);
+			fclose(stdout);
+			fclose(stderr);
+		}
+		serve();
+	}
+
+	close(apply_pair[1]);
+	close(lookup_pair[1]);
+	close(ready[1]);
+	apply_fd = apply_pair[0];
+	lookup_fd = lookup_pair[0];
+
+	/* the pipe gets closed without data by the helper, also when it dies */
+	char c;
+	while (read(ready[0], &c, 1) == -1) {
+		if (errno != EINTR) p_die("read");
+	}
+	close(ready[0]);
+	struct pollfd check = { .fd = apply_fd, .events = 0 };
+	if (poll(&check, 1, 0) == 1) die("DNAT helper could not be started");
+	helper_read_rule_ports();
+}
+
+/* function that closes the connection, the helper exits then */
+void helper_close() {
+	if (apply_fd != -1) close(apply_fd);
+	if (lookup_fd != -1) close(lookup_fd);
+	apply_fd = lookup_fd = -1;
+}
+
+/* apply and commit a batch of changes, the results get stored in the records, return 0 on success and -1 on failure */
+int helper_apply(struct helper_record * r, const size_t count) {
+	if (count == 0) return 0;
+	pthread_mutex_lock(&apply_lock);
+	send_msg(apply_fd, r, count * sizeof(*r));
+	if (recv_msg(apply_fd, r, count * sizeof(*r)) != count * sizeof(*r)) die("DNAT helper is gone");
+	pthread_mutex_unlock(&apply_lock);
+	helper_read_rule_ports();
+	return 0;
+}
+
+/* destroy a single DNAT rule and commit it, returns the same as destroy_rule() of the backend */
+int helper_destroy_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	struct helper_record r = { HELPER_DESTROY, protocol, public_port, client, private_port, 0 };
+	helper_apply(&r, 1);
+	return r.result;
+}
+
+/* function that does a lookup in the helper */
+static int lookup(struct helper_record * r) {
+	pthread_mutex_lock(&lookup_lock);
+	send_msg(lookup_fd, r, sizeof(*r));
+	if (recv_msg(lookup_fd, r, sizeof(*r)) != sizeof(*r)) die("DNAT helper is gone");
+	pthread_mutex_unlock(&lookup_lock);
+	return r->result;
+}
+
+/* let the backend read its rules again */
+void helper_reload() {
+	struct helper_record r = { HELPER_RELOAD, 0, 0, 0, 0, 0 };
+	lookup(&r);
+	helper_read_rule_ports();
+}
+
+/* read the ports of all DNAT rules into rule_ports, which keeps the ports
+ * read before if the backend fails */
+void helper_read_rule_ports() {
+	struct helper_record r = { HELPER_LIST_PORTS, 0, 0, 0, 0, 0 };
+	struct helper_ports answer;
+	pthread_mutex_lock(&lookup_lock);
+	send_msg(lookup_fd, &r, sizeof(r));
+	if (recv_msg(lookup_fd, &answer, sizeof(answer)) != sizeof(answer)) die("DNAT helper is gone");
+	pthread_mutex_unlock(&lookup_lock);
+	if (answer.result == -1) {
+		debug_printf("Reading the ports of the DNAT rules failed\n");
+	}
+	else portmap_copy(&rule_ports, &answer.ports);
+}
+
+/* call found() for every DNAT rule created by this program, returns the same as list_rules() of the backend */
+int helper_list_rules(void (*found)(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port)) {
+	struct helper_record r = { HELPER_LIST, 0, 0, 0, 0, 0 };
+	pthread_mutex_lock(&lookup_lock);
+	send_msg(lookup_fd, &r, sizeof(r));
+	while (1) {
+		struct helper_record batch[HELPER_BATCH_MAXSIZE];
+		size_t count = recv_msg(lookup_fd, batch, sizeof(batch)) / sizeof(*batch);
+		if (count == 0) die("DNAT helper is gone");
+		size_t i;
+		for (i = 0; i < count; i++) {
+			if (batch[i].type == HELPER_LIST_END) {
+				pthread_mutex_unlock(&lookup_lock);
+				return batch[i].result;
+			}
+			found(batch[i].protocol, batch[i].public_port, batch[i].client, batch[i].private_port);
+		}
+	}
+}
+
+/* same as get_rule_by_public_port() of the backend */
+int helper_get_rule_by_public_port(const char protocol, const uint16_t public_port, uint32_t * client, uint16_t * private_port) {
+	struct helper_record r = { HELPER_GET_BY_PUBLIC_PORT, protocol, public_port, 0, 0, 0 };
+	int ret = lookup(&r);
+	if (ret == 1) {
+		if (client) *client = r.client;
+		if (private_port) *private_port = r.private_port;
+	}
+	return ret;
+}
+
+/* same as get_rule_by_client_port() of the backend */
+int helper_get_rule_by_client_port(const char protocol, uint16_t * public_port, const uint32_t client, const uint16_t private_port) {
+	struct helper_record r = { HELPER_GET_BY_CLIENT_PORT, protocol, 0, client, private_port, 0 };
+	int ret = lookup(&r);
+	if (ret == 1 && public_port) *public_port = r.public_port;
+	return ret;
+}
@@ -0,0 +1,86 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DNAT_HELPER_H
+#define DNAT_HELPER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "portmap.h"
+
+/*
+ * The backend runs in a helper process, which keeps the privileges the daemon
+ * drops. The daemon sends records over two socket pairs: one for changes,
+ * which are applied and committed as a batch per message and answered with the
+ * results, and one for lookups, which a thread of its own serves in the
+ * helper, so lookups from the workers don't have to wait for a batch being
+ * committed. The records are copied in native byte order, except the fields
+ * being in network byte order anyway.
+ * The daemon keeps a bitmap of the public ports of all DNAT rules, also of the
+ * ones it didn't create, read from the helper at the start, after every batch
+ * and after reloading, so searching a free port needs no lookups.
+ */
+
+#define HELPER_CREATE 1
+#define HELPER_DESTROY 2
+#define HELPER_GET_BY_PUBLIC_PORT 3
+#define HELPER_GET_BY_CLIENT_PORT 4
+#define HELPER_RELOAD 5
+/* answered with a HELPER_LIST record for every rule and a HELPER_LIST_END record */
+#define HELPER_LIST 6
+#define HELPER_LIST_END 7
+/* answered with a struct helper_ports */
+#define HELPER_LIST_PORTS 8
+
+struct helper_record {
+	uint8_t type;
+	char protocol;
+	uint16_t public_port;
+	uint32_t client;
+	uint16_t private_port;
+	/* return value of the backend function */
+	int16_t result;
+};
+
+/* the public ports of all DNAT rules, of both protocols */
+struct helper_ports {
+	/* return value of the backend function */
+	int32_t result;
+	struct portmap ports;
+};
+
+/* maximal number of records in a batch */
+#define HELPER_BATCH_MAXSIZE 1024
+
+/* public ports of all DNAT rules, in host byte order */
+extern struct portmap rule_ports;
+
+void helper_start(int argc, char * argv[]);
+void helper_close();
+
+int helper_apply(struct helper_record * r, const size_t count);
+int helper_destroy_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port);
+int helper_get_rule_by_public_port(const char protocol, const uint16_t public_port, uint32_t * client, uint16_t * private_port);
+int helper_get_rule_by_client_port(const char protocol, uint16_t * public_port, const uint32_t client, const uint16_t private_port);
+void helper_reload();
+int helper_list_rules(void (*found)(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port));
+void helper_read_rule_ports();
+
+#endif /* DNAT_HELPER_H */
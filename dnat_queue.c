@@ -0,0 +1,196 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "die.h"
+#include "dnat_helper.h"
+#include "dnat_queue.h"
+
+#if DNAT_QUEUE_SIZE > HELPER_BATCH_MAXSIZE
+#error "DNAT_QUEUE_SIZE must not be bigger than HELPER_BATCH_MAXSIZE"
+#endif
+
+/* a queue with its worker, the main thread is the one posting operations */
+struct dnat_queue {
+	/* the operations, results are written by the worker */
+	struct helper_record ring[DNAT_QUEUE_SIZE];
+	/* the worker's copy of a batch */
+	struct helper_record batch[DNAT_QUEUE_SIZE];
+
+	/* next sequence number to post, written by the main thread only */
+	uint64_t head;
+	/* all operations below are committed, written by the worker only */
+	uint64_t done;
+	/* all operations below may be overwritten, only used by the main thread */
+	uint64_t released;
+	/* value of head when the worker got woken up last */
+	uint64_t flushed;
+
+	/* eventfds for waking up the worker and for signalling completions */
+	int work_fd;
+	int done_fd;
+	int stopping;
+
+	pthread_t worker;
+};
+
+/* the queue of the calling thread, every thread handling requests has its own */
+static __thread struct dnat_queue * q = NULL;
+
+/* function that adds a value to an eventfd */
+static void wake(const int fd) {
+	uint64_t one = 1;
+	while (write(fd, &one, sizeof(one)) == -1) {
+		if (errno != EINTR) p_die("write");
+	}
+}
+
+/* function that runs in the worker thread, sends batches of operations to the helper */
+static void * work(void * arg) {
+	struct dnat_queue * w = arg;
+	uint64_t pos = 0;
+	while (1) {
+		uint64_t wakeups;
+		if (read(w->work_fd, &wakeups, sizeof(wakeups)) == -1) {
+			if (errno == EINTR) continue;
+			p_die("read");
+		}
+
+		uint64_t end = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+		if (pos == end && __atomic_load_n(&w->stopping, __ATOMIC_ACQUIRE)) return NULL;
+		/* the batch may wrap around the end of the ring */
+		size_t count = end - pos;
+		uint64_t i;
+		for (i = 0; i < count; i++) w->batch[i] = w->ring[(pos + i) & (DNAT_QUEUE_SIZE - 1)];
+		helper_apply(w->batch, count);
+		for (i = 0; i < count; i++) w->ring[(pos + i) & (DNAT_QUEUE_SIZE - 1)].result = w->batch[i].result;
+		pos = end;
+
+		__atomic_store_n(&w->done, end, __ATOMIC_RELEASE);
+		wake(w->done_fd);
+		if (__atomic_load_n(&w->stopping, __ATOMIC_ACQUIRE) && end == __atomic_load_n(&w->head, __ATOMIC_ACQUIRE)) return NULL;
+	}
+}
+
+/* function that starts the worker of the calling thread's queue, must be called after forking */
+void dnat_queue_init() {
+	q = calloc(1, sizeof(*q));
+	if (q == NULL) p_die("calloc");
+	q->work_fd = eventfd(0, EFD_CLOEXEC);
+	if (q->work_fd == -1) p_die("eventfd");
+	q->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (q->done_fd == -1) p_die("eventfd");
+
+	/* signals are handled by the main thread only */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int err = pthread_create(&q->worker, NULL, work, q);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		errno = err;
+		p_die("pthread_create");
+	}
+}
+
+/* function that applies the remaining operations and stops the worker */
+void dnat_queue_close() {
+	/* threads without a queue, e.g. a worker exiting, have nothing to close */
+	if (q == NULL) return;
+	__atomic_store_n(&q->stopping, 1, __ATOMIC_RELEASE);
+	wake(q->work_fd);
+	pthread_join(q->worker, NULL);
+	close(q->work_fd);
+	close(q->done_fd);
+	free(q);
+	q = NULL;
+}
+
+/* return the file descriptor getting readable when operations are done */
+int dnat_queue_fd() {
+	return q->done_fd;
+}
+
+/* return the number of operations that can be posted */
+uint32_t dnat_queue_space() {
+	return DNAT_QUEUE_SIZE - (q->head - q->released);
+}
+
+/* return the sequence number the next operation will get */
+uint64_t dnat_queue_head() {
+	return q->head;
+}
+
+/* function that posts an operation, the caller must assure there is space */
+static uint64_t post(const char type, const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	if (dnat_queue_space() == 0) die("dnat_queue: queue overflow");
+	struct helper_record * op = &q->ring[q->head & (DNAT_QUEUE_SIZE - 1)];
+	op->type = type;
+	op->protocol = protocol;
+	op->public_port = public_port;
+	op->client = client;
+	op->private_port = private_port;
+	op->result = 0;
+	__atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+	return q->head - 1;
+}
+
+uint64_t dnat_queue_create(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	return post(HELPER_CREATE, protocol, public_port, client, private_port);
+}
+
+uint64_t dnat_queue_destroy(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	return post(HELPER_DESTROY, protocol, public_port, client, private_port);
+}
+
+/* function that wakes up the worker if operations got posted since the last call */
+void dnat_queue_flush() {
+	if (q->flushed == q->head) return;
+	q->flushed = q->head;
+	wake(q->work_fd);
+}
+
+/* return the sequence number up to which all operations are done and clear the file descriptor */
+uint64_t dnat_queue_done() {
+	uint64_t count;
+	if (read(q->done_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) p_die("read");
+	return __atomic_load_n(&q->done, __ATOMIC_ACQUIRE);
+}
+
+/* return the result of a done operation, as returned by the backend */
+int dnat_queue_result(const uint64_t seq) {
+	return q->ring[seq & (DNAT_QUEUE_SIZE - 1)].result;
+}
+
+/* return an operation not released yet */
+const struct helper_record * dnat_queue_op(const uint64_t seq) {
+	return &q->ring[seq & (DNAT_QUEUE_SIZE - 1)];
+}
+
+/* function that allows overwriting all operations below seq */
+void dnat_queue_release(const uint64_t seq) {
+	q->released = seq;
+}
@@ -0,0 +1,56 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DNAT_QUEUE_H
+#define DNAT_QUEUE_H
+
+#include <stdint.h>
+
+#include "dnat_helper.h"
+
+/*
+ * Changes of DNAT rules are posted to a worker thread, which passes them to the
+ * helper process in batches, so answering clients never waits for the backend.
+ * The queue is a ring buffer with a single producer, the main thread, and a
+ * single consumer, the worker, which needs no locks. Every operation gets a
+ * sequence number, an operation is done when its number is lower than
+ * dnat_queue_done(). Its result stays readable until it gets released.
+ * Completions are signalled through the file descriptor of dnat_queue_fd().
+ * Every thread handling requests posts to a queue and worker of its own.
+ */
+
+/* maximal number of operations not yet released, must be a power of two */
+#define DNAT_QUEUE_SIZE 1024
+
+void dnat_queue_init();
+void dnat_queue_close();
+int dnat_queue_fd();
+
+uint32_t dnat_queue_space();
+uint64_t dnat_queue_head();
+uint64_t dnat_queue_create(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port);
+uint64_t dnat_queue_destroy(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port);
+void dnat_queue_flush();
+
+uint64_t dnat_queue_done();
+int dnat_queue_result(const uint64_t seq);
+const struct helper_record * dnat_queue_op(const uint64_t seq);
+void dnat_queue_release(const uint64_t seq);
+
+#endif /* DNAT_QUEUE_H */
@@ -22,15 +22,28 @@
 PUBLIC_IF=vlan1
 PRIVATE_IFS="eth1 br0"
 IPTABLES_CHAIN=natpmp
+# Set to a file to keep the leases over restarts of the daemon.
+JOURNAL=
+# Lifetime of the leases adopted from the rules in the natpmp chain on start,
+# set to empty to flush the chain instead.
+GRACE_LIFETIME=300
+# Set to a user to run the daemon as, only its backend helper keeps running as root.
+RUN_AS=
 
 IP=`which ip`
 IPTABLES=`which iptables`
 NATPMP=./natpmp
 
 if [ "${USER:-$LOGNAME}" = "root" ] ; then
-	# Flush all the rules in the natpmp chain, or create it, if it doesn't exists.
-	$IPTABLES -t nat -F $IPTABLES_CHAIN 2>/dev/null || \
-	$IPTABLES -t nat -N $IPTABLES_CHAIN
+	if [ -n "$JOURNAL" -o -n "$GRACE_LIFETIME" ] ; then
+		# Keep the rules in the natpmp chain, the daemon restores the leases
+		# from the journal or adopts them, or create it, if it doesn't exists.
+		$IPTABLES -t nat -N $IPTABLES_CHAIN 2>/dev/null || true
+	else
+		# Flush all the rules in the natpmp chain, or create it, if it doesn't exists.
+		$IPTABLES -t nat -F $IPTABLES_CHAIN 2>/dev/null || \
+		$IPTABLES -t nat -N $IPTABLES_CHAIN
+	fi
 
 	# Handle all incoming connections in the natpmp chain.
 	$IPTABLES -t nat -D PREROUTING -j $IPTABLES_CHAIN 2>/dev/null || true
@@ -58,4 +71,4 @@ if [ -z "$BIND_ARGS" ] ; then
 	exit 1
 fi
 
-exec $NATPMP -b -i "$PUBLIC_IF" $BIND_ARGS -- "$IPTABLES_CHAIN"
+exec $NATPMP -b -i "$PUBLIC_IF" $BIND_ARGS ${JOURNAL:+-j "$JOURNAL"} ${GRACE_LIFETIME:+-g "$GRACE_LIFETIME"} ${RUN_AS:+-U "$RUN_AS"} -- "$IPTABLES_CHAIN"
@@ -0,0 +1,310 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "die.h"
+#include "dnat_api.h"
+#include "dnat_helper.h"
+#include "journal.h"
+
+/* version 2 keeps the times in seconds of CLOCK_MONOTONIC, which only hold within a boot,
+ * version 3 alternates between two files instead of renaming a new one over the old one,
+ * version 4 records the number of workers */
+#define JOURNAL_MAGIC "NATPMPJ4"
+#define JOURNAL_MINSIZE 1024 /* records */
+#define BOOT_ID_FILE "/proc/sys/kernel/random/boot_id"
+
+struct journal_header {
+	char magic[8];
+	/* the boot_id of the system the journal was written on */
+	char boot_id[40];
+	/* time the epoch started */
+	uint32_t timestamp;
+	/* number of records written and room for records */
+	uint32_t count;
+	uint32_t size;
+	/* the file with the higher generation is the journal, 0 while being written */
+	uint32_t generation;
+	/* number of workers, clients belong to other workers if it changes */
+	uint32_t workers;
+};
+
+/* the state of a lease after a change, same semantics as in struct lease, a
+ * record with both expires values set to UINT32_MAX removes the lease */
+struct journal_record {
+	uint32_t client;
+	uint16_t private_port;
+	uint16_t public_port;
+	uint32_t expires[2];
+};
+
+struct journal {
+	struct journal_header header;
+	struct journal_record records[];
+};
+
+/*
+ * Every worker thread journals its own lease table to files of its own. The
+ * journal gets compacted into the other one of two files, which then takes
+ * over, so no files get created after opening them. This way the daemon
+ * doesn't need to write to the directory after dropping its privileges.
+ */
+
+/* the journal files, the one in use and the other one to compact into */
+static __thread int journal_fds[2] = { -1, -1 };
+static __thread int journal_current = 0;
+/* the mapped journal, NULL if no journal is used */
+static __thread struct journal * journal = NULL;
+static __thread size_t journal_length = 0;
+/* room for records, set at opening the journal */
+static __thread uint32_t journal_size = 0;
+static __thread uint32_t journal_workers = 0;
+
+/* function that reads the boot_id of the running system */
+static void get_boot_id(char * boot_id, const size_t len) {
+	memset(boot_id, 0, len);
+	FILE * f = fopen(BOOT_ID_FILE, "r");
+	if (f == NULL) return;
+	if (fgets(boot_id, len, f) == NULL) memset(boot_id, 0, len);
+	fclose(f);
+}
+
+/* function that maps a journal file of the given size, returns the mapping */
+static struct journal * map_journal(const int fd, const size_t length) {
+	struct journal * j = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (j == MAP_FAILED) p_die("mmap");
+	return j;
+}
+
+/* function that returns the expires value of a protocol of a lease as far as
+ * its DNAT rule is committed, protocols with a rule creation still queued are
+ * journaled when it is done */
+static uint32_t committed_expires(const lease_t a, const char protocol) {
+	return (leases.pending[a] & 1 << protocol) ? UINT32_MAX : leases.expires[(int) protocol][a];
+}
+
+/* function that writes all leases to the other journal file, which then
+ * takes over, generation is the one of the journal in use */
+static void compact(const uint32_t timestamp, const uint32_t generation) {
+	int target = !journal_current;
+	size_t length = sizeof(struct journal_header) + journal_size * sizeof(struct journal_record);
+	if (ftruncate(journal_fds[target], length) == -1) p_die("ftruncate");
+	struct journal * j = map_journal(journal_fds[target], length);
+
+	/* a crash while writing must not leave a valid journal behind */
+	j->header.generation = 0;
+	__sync_synchronize();
+	memcpy(j->header.magic, JOURNAL_MAGIC, sizeof(j->header.magic));
+	get_boot_id(j->header.boot_id, sizeof(j->header.boot_id));
+	j->header.timestamp = timestamp;
+	j->header.size = journal_size;
+	j->header.workers = journal_workers;
+
+	uint32_t count = 0;
+	lease_t a = NO_LEASE;
+	while ((a = get_next_lease(a)) != NO_LEASE) {
+		/* leases without a committed rule yet are left out */
+		if (committed_expires(a, UDP) == UINT32_MAX && committed_expires(a, TCP) == UINT32_MAX) continue;
+		struct journal_record * r = &j->records[count++];
+		r->client = leases.client[a];
+		r->private_port = leases.private_port[a];
+		r->public_port = leases.public_port[a];
+		r->expires[0] = committed_expires(a, UDP);
+		r->expires[1] = committed_expires(a, TCP);
+	}
+	j->header.count = count;
+	__sync_synchronize();
+	j->header.generation = generation + 1;
+
+	if (journal) munmap(journal, journal_length);
+	journal = j;
+	journal_length = length;
+	journal_current = target;
+	debug_printf("Journal compacted to %u records\n", count);
+}
+
+/* function that rebuilds the lease table from a journal, leases not fitting
+ * into the port range or the lease table get their rules destroyed */
+static void replay(const struct journal * j, const uint16_t port_low, const uint16_t port_high) {
+	uint32_t i;
+	for (i = 0; i < j->header.count && i < j->header.size; i++) {
+		const struct journal_record * r = &j->records[i];
+		lease_t a = get_lease_by_port(r->public_port);
+		if (a != NO_LEASE && (leases.client[a] != r->client || leases.private_port[a] != r->private_port)) {
+			remove_lease(a);
+			a = NO_LEASE;
+		}
+		if (r->expires[0] == UINT32_MAX && r->expires[1] == UINT32_MAX) {
+			if (a != NO_LEASE) remove_lease(a);
+			continue;
+		}
+
+		if (a == NO_LEASE && ntohs(r->public_port) >= port_low && ntohs(r->public_port) <= port_high)
+			a = add_lease(r->client, r->private_port, r->public_port);
+		/* the port belongs to a lease of another worker, leave its rule alone */
+		if (a == NO_LEASE && portmap_test(&leased_ports, ntohs(r->public_port))) continue;
+		if (a != NO_LEASE) {
+			set_lease_expires(a, UDP, r->expires[0]);
+			set_lease_expires(a, TCP, r->expires[1]);
+			continue;
+		}
+
+		char protocol;
+		for (protocol = UDP; protocol <= TCP; protocol++) {
+			if (r->expires[protocol - 1] == UINT32_MAX) continue;
+			if (helper_destroy_rule(protocol, r->public_port, r->client, r->private_port) == -1)
+				die("destroy_rule returned with error");
+		}
+	}
+}
+
+/* function that opens the two files of a journal, creating them if needed, must
+ * be called before dropping privileges, fds get passed to journal_open() */
+void journal_prepare(const char * path, int fds[2]) {
+	char alt_path[strlen(path) + 5];
+	snprintf(alt_path, sizeof(alt_path), "%s.alt", path);
+	fds[0] = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fds[0] == -1) p_die("open");
+	fds[1] = open(alt_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fds[1] == -1) p_die("open");
+}
+
+/* function that maps a journal file if it holds a journal written since the
+ * last boot by as many workers, and of the given epoch if timestamp is not
+ * NULL, returns NULL if not and sets length to the mapped length */
+static struct journal * map_valid(const char * path, const int fd, const uint32_t * timestamp, size_t * length) {
+	struct stat st;
+	if (fstat(fd, &st) == -1) p_die("fstat");
+	if (st.st_size < (off_t) sizeof(struct journal_header)) return NULL;
+
+	struct journal * j = map_journal(fd, st.st_size);
+	char boot_id[sizeof(j->header.boot_id)];
+	get_boot_id(boot_id, sizeof(boot_id));
+	if (memcmp(j->header.magic, JOURNAL_MAGIC, sizeof(j->header.magic)) != 0 || j->header.generation == 0) {
+		debug_printf("Journal file %s is invalid\n", path);
+	}
+	else if (boot_id[0] == '\0' || memcmp(j->header.boot_id, boot_id, sizeof(boot_id)) != 0) {
+		debug_printf("Journal file %s was written before last boot\n", path);
+	}
+	else if (sizeof(struct journal_header) + (size_t) j->header.size * sizeof(struct journal_record) > (size_t) st.st_size) {
+		debug_printf("Journal file %s is truncated\n", path);
+	}
+	else if (j->header.workers != journal_workers) {
+		debug_printf("Journal file %s was written by %u workers\n", path, j->header.workers);
+	}
+	else if (timestamp && j->header.timestamp != *timestamp) {
+		debug_printf("Journal file %s is of another epoch than the first worker's\n", path);
+	}
+	else {
+		*length = st.st_size;
+		return j;
+	}
+	munmap(j, st.st_size);
+	return NULL;
+}
+
+/* function that takes the files opened by journal_prepare(), restores the
+ * leases and the timestamp from the newer one if it was written since the last
+ * boot and starts a fresh journal in the other one, journals written by
+ * another number of workers hold leases of other workers' clients and are not
+ * restored, if same_epoch is set neither are those of an epoch other than the
+ * one in timestamp */
+void journal_open(const char * path, const int fds[2], const uint16_t port_low, const uint16_t port_high, const uint32_t workers,
+		const int same_epoch, uint32_t * timestamp) {
+	journal_fds[0] = fds[0];
+	journal_fds[1] = fds[1];
+	journal_workers = workers;
+
+	char alt_path[strlen(path) + 5];
+	snprintf(alt_path, sizeof(alt_path), "%s.alt", path);
+	size_t length[2];
+	struct journal * j[2];
+	j[0] = map_valid(path, fds[0], (same_epoch) ? timestamp : NULL, &length[0]);
+	j[1] = map_valid(alt_path, fds[1], (same_epoch) ? timestamp : NULL, &length[1]);
+
+	uint32_t generation = 0;
+	journal_current = 1;
+	if (j[0] || j[1]) {
+		journal_current = (j[1] && (j[0] == NULL || j[1]->header.generation > j[0]->header.generation));
+		struct journal * newest = j[journal_current];
+		replay(newest, port_low, port_high);
+		*timestamp = newest->header.timestamp;
+		generation = newest->header.generation;
+		debug_printf("Restored leases from journal %s\n", (journal_current) ? alt_path : path);
+	}
+	int i;
+	for (i = 0; i < 2; i++) {
+		if (j[i]) munmap(j[i], length[i]);
+	}
+
+	/* room for every lease to change twice before compacting */
+	journal_size = 2 * (uint32_t) (port_high - port_low + 1);
+	if (journal_size < JOURNAL_MINSIZE) journal_size = JOURNAL_MINSIZE;
+	compact(*timestamp, generation);
+}
+
+/* function that appends a record to the journal */
+static void append(const uint32_t client, const uint16_t private_port, const uint16_t public_port, const uint32_t expires_udp, const uint32_t expires_tcp) {
+	if (journal == NULL) return;
+	if (journal->header.count == journal_size) {
+		/* the compacted journal already contains the state of the lease */
+		compact(journal->header.timestamp, journal->header.generation);
+		return;
+	}
+	struct journal_record * r = &journal->records[journal->header.count];
+	r->client = client;
+	r->private_port = private_port;
+	r->public_port = public_port;
+	r->expires[0] = expires_udp;
+	r->expires[1] = expires_tcp;
+	/* make the record valid only after it has been written */
+	__sync_synchronize();
+	journal->header.count++;
+}
+
+/* function that appends the state of a lease to the journal, must be called
+ * after every change of a lease, changes of DNAT rules after being committed */
+void journal_write(const lease_t a) {
+	append(leases.client[a], leases.private_port[a], leases.public_port[a], committed_expires(a, UDP), committed_expires(a, TCP));
+}
+
+/* function that appends the removal of a lease already gone from the lease table */
+void journal_write_removal(const uint32_t client, const uint16_t private_port, const uint16_t public_port) {
+	append(client, private_port, public_port, UINT32_MAX, UINT32_MAX);
+}
+
+/* function that unmaps and closes the journal, leaving the file for the next
+ * start */
+void journal_close() {
+	if (journal == NULL) return;
+	munmap(journal, journal_length);
+	close(journal_fds[0]);
+	close(journal_fds[1]);
+	journal = NULL;
+	journal_fds[0] = journal_fds[1] = -1;
+}
@@ -0,0 +1,41 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#include "leases.h"
+
+/*
+ * The journal is a memory mapped file the state of every changed lease gets
+ * appended to, after its DNAT rules have been changed. It survives a restart
+ * of the daemon, but not a reboot of the system, as the DNAT rules don't
+ * either.
+ */
+
+void journal_prepare(const char * path, int fds[2]);
+void journal_open(const char * path, const int fds[2], const uint16_t port_low, const uint16_t port_high, const uint32_t workers,
+		const int same_epoch, uint32_t * timestamp);
+void journal_write(const lease_t a);
+void journal_write_removal(const uint32_t client, const uint16_t private_port, const uint16_t public_port);
+void journal_close();
+
+#endif /* JOURNAL_H */
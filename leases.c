@@ -18,158 +18,533 @@
  */
 
 
+#include <arpa/inet.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef DEBUG_LEASES
-#include <arpa/inet.h>
 #include <stdio.h>
 #endif
 
 #include "die.h"
 #include "leases.h"
 
-/* linked list of leases */
-struct lease *first = NULL;
-struct lease *last = NULL;
+/*
+ * Every worker thread has a lease table of its own, holding the leases of its
+ * clients, so all state below is thread local. Only the public ports are
+ * shared, a lease owns its port by setting its bit in leased_ports, and the
+ * total number of leases is limited across all tables.
+ */
+
+/* the fields of the leases that get scanned or compared on lookups */
+__thread struct lease_table leases;
+
+/* maximal number of leases, set by leases_init(), and the number of lease
+ * slots that ever have been used, slots get handed out from the beginning
+ * and recycled through a free list chained through hash_next */
+static __thread uint32_t lease_capacity = 0;
+static __thread uint32_t lease_count = 0;
+static __thread uint32_t lease_pool_used = 0;
+static __thread lease_t lease_free = NO_LEASE;
+
+/* the fields of the leases only used for maintaining the indexes */
+static __thread lease_t *hash_next = NULL;
+static __thread uint32_t *owner = NULL;
+static __thread lease_t *client_prev = NULL;
+static __thread lease_t *client_next = NULL;
+static __thread uint32_t *heap_index = NULL;
+
+/* index of leases by public port number, direct-mapped, indexed by the port
+ * number in host byte order, allocated by leases_init() so only the threads
+ * with a lease table pay for it */
+static __thread lease_t *port_index = NULL;
+/* the ports of the leases of all tables as bitmap for scanning for unused
+ * ports */
+struct portmap leased_ports;
+/* number of leases in all tables and the maximum for all tables together */
+static uint32_t lease_total = 0;
+static uint32_t lease_limit = 0;
+
+/* hash table of leases by client ip address and private port number, chained
+ * through hash_next, the number of buckets is a power of two not smaller than
+ * lease_capacity */
+static __thread lease_t *client_port_hash = NULL;
+static __thread uint32_t client_port_hash_size = 0;
+
+/* a client owning at least one lease, the leases of a client are chained
+ * through client_prev and client_next */
+struct client {
+	/* IP address in network byte order */
+	uint32_t address;
+	/* number of leases in the chain */
+	uint32_t lease_count;
+	lease_t first;
+	/* next client in the same bucket of the client hash */
+	uint32_t hash_next;
+};
+#define NO_CLIENT UINT32_MAX
+
+/* pool of clients, there are never more clients than leases, recycled through
+ * a free list chained through hash_next */
+static __thread struct client *client_pool = NULL;
+static __thread uint32_t client_pool_used = 0;
+static __thread uint32_t client_free = NO_CLIENT;
+
+/* hash table of clients, chained through hash_next, sized like
+ * client_port_hash */
+static __thread uint32_t *client_hash = NULL;
+static __thread uint32_t client_hash_size = 0;
+
+/* vector of four expires values for scanning the lease table */
+typedef uint32_t v4u32 __attribute__ ((vector_size (16)));
+#define VECTOR_LEASES (sizeof(v4u32) / sizeof(uint32_t))
+
+/* function that allocates an array, exits on failure */
+static void *xmalloc(const size_t size)
+{
+	void *p = malloc(size);
+	if (p == NULL) p_die("malloc");
+	return p;
+}
+
+/* function that mixes a 32 bit key into a hash value */
+static uint32_t hash32(uint32_t h)
+{
+	h *= 0x9e3779b1;
+	return h ^ h >> 15;
+}
+
+/* function that returns the bucket for a client ip address and private port
+ * number */
+static lease_t *client_port_bucket(const uint32_t client,
+		const uint16_t port)
+{
+	uint32_t h = hash32(client ^ ((uint32_t) port << 16 | port));
+	return &client_port_hash[h & (client_port_hash_size - 1)];
+}
+
+/* function that returns the bucket for a client ip address */
+static uint32_t *client_bucket(const uint32_t client)
+{
+	return &client_hash[hash32(client) & (client_hash_size - 1)];
+}
+
+/* function that returns a client by ip address, NO_CLIENT if the client has
+ * no leases */
+static uint32_t get_client(const uint32_t client)
+{
+	uint32_t c = *client_bucket(client);
+	for (; c != NO_CLIENT; c = client_pool[c].hash_next) {
+		if (client_pool[c].address == client) return c;
+	}
+	return NO_CLIENT;
+}
+
+/* function that links a lease into the chain of its client, the client gets
+ * created if it has no leases yet */
+static void client_link(const lease_t a)
+{
+	uint32_t c = get_client(leases.client[a]);
+	if (c == NO_CLIENT) {
+		if (client_free != NO_CLIENT) {
+			c = client_free;
+			client_free = client_pool[c].hash_next;
+		}
+		else c = client_pool_used++;
+		client_pool[c].address = leases.client[a];
+		client_pool[c].lease_count = 0;
+		client_pool[c].first = NO_LEASE;
+
+		uint32_t *b = client_bucket(client_pool[c].address);
+		client_pool[c].hash_next = *b;
+		*b = c;
+	}
+
+	owner[a] = c;
+	client_prev[a] = NO_LEASE;
+	client_next[a] = client_pool[c].first;
+	if (client_pool[c].first != NO_LEASE)
+		client_prev[client_pool[c].first] = a;
+	client_pool[c].first = a;
+	client_pool[c].lease_count++;
+}
+
+/* function that unlinks a lease from the chain of its client, the client gets
+ * removed when its last lease is gone */
+static void client_unlink(const lease_t a)
+{
+	uint32_t c = owner[a];
+	if (client_prev[a] != NO_LEASE) client_next[client_prev[a]] = client_next[a];
+	else client_pool[c].first = client_next[a];
+	if (client_next[a] != NO_LEASE) client_prev[client_next[a]] = client_prev[a];
+
+	if (--client_pool[c].lease_count == 0) {
+		uint32_t *b = client_bucket(client_pool[c].address);
+		while (*b != c) b = &client_pool[*b].hash_next;
+		*b = client_pool[c].hash_next;
+		client_pool[c].hash_next = client_free;
+		client_free = c;
+	}
+}
+
+/* binary min-heap of leases ordered by the earlier of their two expires
+ * values, every lease stores its position in heap_index, has room for
+ * lease_capacity leases */
+static __thread lease_t *expires_heap = NULL;
+static __thread uint32_t expires_heap_count = 0;
+
+/* function that returns the time a lease expires next */
+static uint32_t lease_expires(const lease_t a)
+{
+	uint32_t udp = leases.expires[1][a];
+	uint32_t tcp = leases.expires[2][a];
+	return (udp < tcp) ? udp : tcp;
+}
+
+/* function that stores a lease at a position of the heap */
+static void heap_set(const uint32_t i, const lease_t a)
+{
+	expires_heap[i] = a;
+	heap_index[a] = i;
+}
+
+/* function that moves a lease towards the top of the heap */
+static void heap_up(uint32_t i)
+{
+	lease_t a = expires_heap[i];
+	uint32_t key = lease_expires(a);
+	while (i > 0) {
+		uint32_t parent = (i - 1) / 2;
+		if (lease_expires(expires_heap[parent]) <= key) break;
+		heap_set(i, expires_heap[parent]);
+		i = parent;
+	}
+	heap_set(i, a);
+}
+
+/* function that moves a lease towards the bottom of the heap */
+static void heap_down(uint32_t i)
+{
+	lease_t a = expires_heap[i];
+	uint32_t key = lease_expires(a);
+	while (1) {
+		uint32_t child = 2 * i + 1;
+		if (child >= expires_heap_count) break;
+		if (child + 1 < expires_heap_count &&
+				lease_expires(expires_heap[child + 1]) <
+				lease_expires(expires_heap[child]))
+			child++;
+		if (key <= lease_expires(expires_heap[child])) break;
+		heap_set(i, expires_heap[child]);
+		i = child;
+	}
+	heap_set(i, a);
+}
+
+/* function that inserts a lease into the heap */
+static void heap_insert(const lease_t a)
+{
+	heap_set(expires_heap_count++, a);
+	heap_up(heap_index[a]);
+}
 
-/* time the next leases expire */
-uint32_t next_lease_expires = UINT32_MAX;
-/* indicates if the next_lease_expires has to be updated, e.g. on change or
- * removal of a lease */
-int update_expires = 0; /* TODO ??? */
+/* function that removes a lease from the heap */
+static void heap_remove(const lease_t a)
+{
+	uint32_t i = heap_index[a];
+	lease_t b = expires_heap[--expires_heap_count];
+	if (b == a) return;
+	heap_set(i, b);
+	heap_up(i);
+	heap_down(heap_index[b]);
+}
 
-/* function that adds a lease to the list of leases */
-struct lease *add_lease(const struct lease *a)
+/* function that allocates the lease table of the calling thread for a maximal
+ * number of leases, limit is the maximal number of leases of all tables
+ * together, must be called before any other function of the lease table */
+void leases_init(const uint32_t capacity, const uint32_t limit)
 {
-	struct lease *new = malloc(sizeof(struct lease));
-	if (new == NULL) p_die("malloc");
-	*new = *a;
+	/* round up to whole vectors, so scans never need a scalar tail */
+	uint32_t slots = (capacity + VECTOR_LEASES - 1) / VECTOR_LEASES * VECTOR_LEASES;
 
-	if (last) last->next = new;
-	else first = new;
-	new->prev = last;
-	new->next = NULL;
-	last = new;
-	return new;
+	lease_capacity = capacity;
+	lease_limit = limit;
+	leases.client = xmalloc(slots * sizeof(*leases.client));
+	leases.private_port = xmalloc(slots * sizeof(*leases.private_port));
+	leases.public_port = xmalloc(slots * sizeof(*leases.public_port));
+	leases.expires[0] = NULL;
+	leases.expires[1] = xmalloc(slots * sizeof(*leases.expires[1]));
+	leases.expires[2] = xmalloc(slots * sizeof(*leases.expires[2]));
+	leases.pending = xmalloc(slots * sizeof(*leases.pending));
+	/* all slots are unused */
+	memset(leases.expires[1], 0xff, slots * sizeof(*leases.expires[1]));
+	memset(leases.expires[2], 0xff, slots * sizeof(*leases.expires[2]));
+
+	hash_next = xmalloc(slots * sizeof(*hash_next));
+	owner = xmalloc(slots * sizeof(*owner));
+	client_prev = xmalloc(slots * sizeof(*client_prev));
+	client_next = xmalloc(slots * sizeof(*client_next));
+	heap_index = xmalloc(slots * sizeof(*heap_index));
+	expires_heap = xmalloc(slots * sizeof(*expires_heap));
+	client_pool = xmalloc(slots * sizeof(*client_pool));
+
+	for (client_port_hash_size = 1; client_port_hash_size < capacity;
+			client_port_hash_size *= 2);
+	client_port_hash = xmalloc(client_port_hash_size *
+			sizeof(*client_port_hash));
+	memset(client_port_hash, 0xff, client_port_hash_size *
+			sizeof(*client_port_hash));
+	client_hash_size = client_port_hash_size;
+	client_hash = xmalloc(client_hash_size * sizeof(*client_hash));
+	memset(client_hash, 0xff, client_hash_size * sizeof(*client_hash));
+
+	port_index = xmalloc((UINT16_MAX + 1) * sizeof(*port_index));
+	memset(port_index, 0xff, (UINT16_MAX + 1) * sizeof(*port_index));
 }
 
-/* function that removes a lease from the list of leases */
-void remove_lease(struct lease *a)
+/* function that frees the lease table with all leases */
+void leases_free()
 {
-	if (a->prev == NULL && a->next == NULL) {
-		first = NULL;
-		last = NULL;
+	/* give the ports back to the other tables */
+	uint32_t port;
+	for (port = 0; port <= UINT16_MAX; port++) {
+		if (lease_capacity && port_index[port] != NO_LEASE)
+			portmap_clear(&leased_ports, port);
 	}
-	else {
-		if (a->prev) a->prev->next = a->next;
-		else first = a->next;
-		if (a->next) a->next->prev = a->prev;
-		else last = a->prev;
+	__atomic_sub_fetch(&lease_total, lease_count, __ATOMIC_RELAXED);
+
+	free(leases.client);
+	free(leases.private_port);
+	free(leases.public_port);
+	free(leases.expires[1]);
+	free(leases.expires[2]);
+	free(leases.pending);
+	memset(&leases, 0, sizeof(leases));
+	free(hash_next);
+	free(owner);
+	free(client_prev);
+	free(client_next);
+	free(heap_index);
+	free(expires_heap);
+	free(client_pool);
+	free(client_port_hash);
+	free(client_hash);
+	free(port_index);
+	hash_next = NULL;
+	owner = NULL;
+	client_prev = NULL;
+	client_next = NULL;
+	heap_index = NULL;
+	expires_heap = NULL;
+	client_pool = NULL;
+	client_port_hash = NULL;
+	client_hash = NULL;
+	port_index = NULL;
+	lease_capacity = 0;
+	lease_count = 0;
+	lease_pool_used = 0;
+	lease_free = NO_LEASE;
+	client_pool_used = 0;
+	client_free = NO_CLIENT;
+	expires_heap_count = 0;
+}
+
+/* function that adds a lease with no protocol in use to the lease table,
+ * returns NO_LEASE if the maximal number of leases is reached or the public
+ * port got leased by another thread, at least one protocol must be set with
+ * set_lease_expires() afterwards */
+lease_t add_lease(const uint32_t client, const uint16_t private_port,
+		const uint16_t public_port)
+{
+	lease_t a;
+	if (leases_full()) return NO_LEASE;
+	if (!portmap_set(&leased_ports, ntohs(public_port))) return NO_LEASE;
+	if (__atomic_add_fetch(&lease_total, 1, __ATOMIC_RELAXED) > lease_limit) {
+		__atomic_sub_fetch(&lease_total, 1, __ATOMIC_RELAXED);
+		portmap_clear(&leased_ports, ntohs(public_port));
+		return NO_LEASE;
 	}
-	free(a);
+	if (lease_free != NO_LEASE) {
+		a = lease_free;
+		lease_free = hash_next[a];
+	}
+	else a = lease_pool_used++;
+	lease_count++;
+
+	leases.client[a] = client;
+	leases.private_port[a] = private_port;
+	leases.public_port[a] = public_port;
+	leases.expires[1][a] = UINT32_MAX;
+	leases.expires[2][a] = UINT32_MAX;
+	leases.pending[a] = 0;
+
+	port_index[ntohs(public_port)] = a;
+
+	lease_t *b = client_port_bucket(client, private_port);
+	hash_next[a] = *b;
+	*b = a;
+
+	client_link(a);
+	heap_insert(a);
+	return a;
+}
+
+/* function that removes a lease from the lease table */
+void remove_lease(const lease_t a)
+{
+	port_index[ntohs(leases.public_port[a])] = NO_LEASE;
+	portmap_clear(&leased_ports, ntohs(leases.public_port[a]));
+
+	lease_t *b = client_port_bucket(leases.client[a], leases.private_port[a]);
+	while (*b != a) b = &hash_next[*b];
+	*b = hash_next[a];
+	lease_count--;
+	__atomic_sub_fetch(&lease_total, 1, __ATOMIC_RELAXED);
+
+	client_unlink(a);
+	heap_remove(a);
+
+	/* mark the slot unused for scans */
+	leases.expires[1][a] = UINT32_MAX;
+	leases.expires[2][a] = UINT32_MAX;
+	hash_next[a] = lease_free;
+	lease_free = a;
+}
+
+/* function that returns 1 if no more leases can be added, 0 if not */
+int leases_full()
+{
+	return lease_count == lease_capacity ||
+		__atomic_load_n(&lease_total, __ATOMIC_RELAXED) >= lease_limit;
 }
 
-/* function that returns a lease pointer by public port number, NULL if public
- * port number is still unmapped */
-struct lease *get_lease_by_port(const uint16_t port)
+/* function that returns a lease by public port number, NO_LEASE if public port
+ * number is still unmapped */
+lease_t get_lease_by_port(const uint16_t port)
 {
-	if (first == NULL) return NULL;
-	struct lease *a = first;
-	do {
-		if (a->public_port == port) return a;
-	} while ((a = a->next));
-	return NULL;
+	return port_index[ntohs(port)];
 }
 
-/* function that returns a lease pointer by client ip address and private port
- * numnber, NULL if no lease found */
-struct lease *get_lease_by_client_port(const uint32_t client,
+/* function that returns a lease by client ip address and private port number,
+ * NO_LEASE if no lease found */
+lease_t get_lease_by_client_port(const uint32_t client,
 		const uint16_t port)
 {
-	if (first == NULL) return NULL;
-	struct lease *a = first;
-	do {
-		if (a->client == client && a->private_port == port) return a;
-	} while ((a = a->next));
-	return NULL;
-}
-
-/* function that returns a pointer to the next lease by client ip address, NULL
- * if no leases found, prev is the pointer to the lease from where to search
- * from, NULL to search from beginning */
-struct lease *get_next_lease_by_client(const uint32_t client,
-		struct lease *prev)
-{
-	if (first == NULL || (prev && prev->next == NULL)) return NULL;
-	struct lease *a = (prev) ? prev->next : first;
-	do {
-		if (a->client == client) return a;
-	} while ((a = a->next));
-	return NULL;
-}
-
-/* function that returns a pointer to the next expired lease, NULL if no leases
- * found, provide the actual time with now, prev is the pointer to the lease
- * from where to search from, NULL to search from beginning */
-struct lease *get_next_expired_lease(const uint32_t now,
-		struct lease *prev)
-{
-	if (first == NULL || (prev && prev->next == NULL)) return NULL;
-	struct lease *a = (prev) ? prev->next : first;
-	do {
-		if (a->expires[1] <= now) return a;
-		if (a->expires[2] <= now) return a;
-	} while ((a = a->next));
-	return NULL;
-}
-
-/* function that updates the next_lease_expires variables */
-void do_update_expires()
-{
-	if (!update_expires) return;
-	next_lease_expires = UINT32_MAX;
-	if (first) {
-		struct lease *a = first;
-		do {
-			if (a->expires[1] < next_lease_expires)
-				next_lease_expires = a->expires[1];
-			if (a->expires[2] < next_lease_expires)
-				next_lease_expires = a->expires[2];
-		} while ((a = a->next));
+	lease_t a = *client_port_bucket(client, port);
+	for (; a != NO_LEASE; a = hash_next[a]) {
+		if (leases.client[a] == client && leases.private_port[a] == port)
+			return a;
 	}
-	update_expires = 0;
-#ifdef DEBUG_LEASES
-	if (debuglevel >= 2)
-		printf("next lease expires: %u\n", next_lease_expires);
-#endif
+	return NO_LEASE;
+}
+
+/* function that returns the next lease in the lease table, NO_LEASE if no
+ * leases left, prev is the lease from where to go on, NO_LEASE to start at the
+ * beginning, scans the expires arrays a vector of slots at a time for slots
+ * with a protocol in use */
+lease_t get_next_lease(const lease_t prev)
+{
+	lease_t a = (prev == NO_LEASE) ? 0 : prev + 1;
+	for (; a < lease_pool_used && a % VECTOR_LEASES; a++) {
+		if ((leases.expires[1][a] & leases.expires[2][a]) != UINT32_MAX)
+			return a;
+	}
+	for (; a < lease_pool_used; a += VECTOR_LEASES) {
+		v4u32 udp, tcp;
+		memcpy(&udp, &leases.expires[1][a], sizeof(udp));
+		memcpy(&tcp, &leases.expires[2][a], sizeof(tcp));
+		/* a slot is unused if both protocols are UINT32_MAX */
+		v4u32 used = (v4u32) ((udp & tcp) != UINT32_MAX);
+		uint64_t mask[2];
+		memcpy(mask, &used, sizeof(mask));
+		if ((mask[0] | mask[1]) == 0) continue;
+
+		uint32_t i;
+		for (i = 0; i < VECTOR_LEASES; i++) {
+			if (used[i]) return (a + i < lease_pool_used) ? a + i : NO_LEASE;
+		}
+	}
+	return NO_LEASE;
+}
+
+/* function that returns the next lease by client ip address, NO_LEASE if no
+ * leases found, prev is the lease from where to search from, NO_LEASE to
+ * search from beginning, the leases of a client are chained through
+ * client_prev and client_next */
+lease_t get_next_lease_by_client(const uint32_t client,
+		const lease_t prev)
+{
+	if (prev != NO_LEASE) return client_next[prev];
+	uint32_t c = get_client(client);
+	return (c != NO_CLIENT) ? client_pool[c].first : NO_LEASE;
+}
+
+/* function that returns the lease before a lease of the same client, NO_LEASE
+ * if it is the first one */
+lease_t get_prev_lease_by_client(const lease_t a)
+{
+	return client_prev[a];
+}
+
+/* function that returns the number of leases of a client */
+uint32_t get_lease_count_by_client(const uint32_t client)
+{
+	uint32_t c = get_client(client);
+	return (c != NO_CLIENT) ? client_pool[c].lease_count : 0;
+}
+
+/* function that sets the expires value of a protocol of a lease, UINT32_MAX
+ * marks the protocol unused */
+void set_lease_expires(const lease_t a, const char protocol,
+		const uint32_t expires)
+{
+	uint32_t old = lease_expires(a);
+	leases.expires[(int) protocol][a] = expires;
+	/* a protocol no more in use has no rule creation to wait for */
+	if (expires == UINT32_MAX) leases.pending[a] &= ~(1 << protocol);
+	if (lease_expires(a) < old) heap_up(heap_index[a]);
+	else heap_down(heap_index[a]);
+}
+
+/* function that returns the time the next lease expires, UINT32_MAX if there
+ * are no leases */
+uint32_t get_next_lease_expires()
+{
+	return (expires_heap_count) ? lease_expires(expires_heap[0]) : UINT32_MAX;
+}
+
+/* function that returns a lease with at least one expired protocol, NO_LEASE
+ * if no lease expired, provide the actual time with now */
+lease_t get_next_expired_lease(const uint32_t now)
+{
+	if (expires_heap_count == 0) return NO_LEASE;
+	lease_t a = expires_heap[0];
+	return (lease_expires(a) <= now) ? a : NO_LEASE;
 }
 
 #ifdef DEBUG_LEASES
 /* function that prints a lease */
-void print_lease(const struct lease *a)
+void print_lease(const lease_t a)
 {
-	struct in_addr client = { a->client };
+	struct in_addr client = { leases.client[a] };
 	printf("Client: %s, UDP-Expires: %u, TCP-Expires: %u, Private: %hu, "
 			"Public: %hu\n",
 			inet_ntoa(client),
-			a->expires[1],
-			a->expires[2],
-			ntohs(a->private_port),
-			ntohs(a->public_port));
+			leases.expires[1][a],
+			leases.expires[2][a],
+			ntohs(leases.private_port[a]),
+			ntohs(leases.public_port[a]));
 }
 
 /* function to print all leases */
 void print_leases()
 {
 	printf("----LEASES----\n");
-	if (first) {
-		struct lease *a = first;
-		do {
-			print_lease(a);
-		} while ((a = a->next));
+	lease_t a = NO_LEASE;
+	while ((a = get_next_lease(a)) != NO_LEASE) {
+		print_lease(a);
 	}
 	printf("--------------\n");
-	if (update_expires == 0)
-		printf("next lease expires: %u\n", next_lease_expires);
+	printf("next lease expires: %u\n", get_next_lease_expires());
 }
 #endif
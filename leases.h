@@ -17,45 +17,64 @@
  *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#ifndef LEASES_H
+#define LEASES_H
 
 #include <stdint.h>
 
+#include "portmap.h"
 
-struct lease {
-	/* IP addresses and port numbers are stored in network byte order! */
-	/* this is a hack for convience, only the fields 1 and 2 are used
-	 * in expires */
-	union {
-		uint32_t client;
-		/* protocols are stored with two different expires fields 1 for
-		 * udp and 2 for tcp, an expires value of UINT32_MAX indicates
-		 * an unused protocol */
-		uint32_t expires[3];
-	};
-	uint16_t private_port;
-	uint16_t public_port;
-	struct lease *prev;
-	struct lease *next;
+
+/* handle of a lease, stays the same as long as the lease exists */
+typedef uint32_t lease_t;
+#define NO_LEASE UINT32_MAX
+
+/*
+ * The leases are stored as a structure of arrays, indexed by the lease handle.
+ * IP addresses and port numbers are stored in network byte order!
+ */
+struct lease_table {
+	uint32_t *client;
+	uint16_t *private_port;
+	uint16_t *public_port;
+	/* protocols are stored with two different expires arrays 1 for udp and
+	 * 2 for tcp, an expires value of UINT32_MAX indicates an unused
+	 * protocol, only the arrays 1 and 2 are used */
+	uint32_t *expires[3];
+	/* protocols with a DNAT rule creation queued but not yet done, bit
+	 * 1 << protocol is set for each of them */
+	uint8_t *pending;
 };
 
+/* the lease table of the calling thread */
+extern __thread struct lease_table leases;
 
-/* time the next leases expire */
-extern uint32_t next_lease_expires;
-extern int update_expires;
+/* public ports used by the leases of all threads */
+extern struct portmap leased_ports;
 
 
-struct lease *add_lease(const struct lease *a);
-void remove_lease(struct lease *a);
-struct lease *get_lease_by_port(const uint16_t port);
-struct lease *get_lease_by_client_port(const uint32_t client,
+void leases_init(const uint32_t capacity, const uint32_t limit);
+void leases_free();
+lease_t add_lease(const uint32_t client, const uint16_t private_port,
+		const uint16_t public_port);
+void remove_lease(const lease_t a);
+int leases_full();
+lease_t get_lease_by_port(const uint16_t port);
+lease_t get_lease_by_client_port(const uint32_t client,
 		const uint16_t port);
-struct lease *get_next_lease_by_client(const uint32_t client,
-		struct lease *prev);
-struct lease *get_next_expired_lease(const uint32_t now,
-		struct lease *prev);
-void do_update_expires();
+lease_t get_next_lease(const lease_t prev);
+lease_t get_next_lease_by_client(const uint32_t client,
+		const lease_t prev);
+lease_t get_prev_lease_by_client(const lease_t a);
+uint32_t get_lease_count_by_client(const uint32_t client);
+void set_lease_expires(const lease_t a, const char protocol,
+		const uint32_t expires);
+uint32_t get_next_lease_expires();
+lease_t get_next_expired_lease(const uint32_t now);
 
 #ifdef DEBUG_LEASES
-void print_lease(const struct lease *a);
+void print_lease(const lease_t a);
 void print_leases();
 #endif
+
+#endif /* LEASES_H */
@@ -33,6 +33,7 @@
 #define IPTABLES_PATH "/sbin"
 #endif
 #define IPTABLES_BIN IPTABLES_PATH "/iptables"
+#define IPTABLES_RESTORE_BIN IPTABLES_PATH "/iptables-restore"
 
 #define CHAIN_NAME_MAXSIZE 30
 #define DEFAULT_CHAIN_NAME "natpmp"
@@ -50,7 +51,7 @@
 
 char chain_name[32] = DEFAULT_CHAIN_NAME;
 
-void dnat_init(int argc, char * argv[]) {
+static void dnat_init(int argc, char * argv[]) {
 	if (argc > 1) die("Give only name of iptables chain as backend option.");
 	if (argc == 0) {
 		debug_printf("Using name of iptables chain default: " DEFAULT_CHAIN_NAME "\n");
@@ -73,44 +74,434 @@ static int call_executable(const char *command) {
 	return system(command);
 }
 
+/* a rule change waiting for dnat_commit() */
+struct rule_change {
+	/* number of the change since dnat_begin() */
+	uint32_t change;
+	char c_arg;
+	char protocol;
+	uint16_t public_port;
+	uint32_t client;
+	uint16_t private_port;
+};
+
+/* queue of rule changes, grows as needed and is reused after every commit */
+static struct rule_change * queue = NULL;
+static size_t queue_size = 0;
+static size_t queue_count = 0;
+/* number of create and destroy calls since dnat_begin() */
+static uint32_t changes = 0;
+
 /* function that gets wrapped by create_dnat_rule() and destroy_dnat_rule() */
-static int change_dnat_rule(const char c_arg, const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
-	char command[256];
+static int change_dnat_rule(const uint32_t change, const char c_arg, const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	if (queue_count == queue_size) {
+		queue_size = (queue_size) ? queue_size * 2 : 64;
+		queue = realloc(queue, queue_size * sizeof(*queue));
+		if (queue == NULL) p_die("realloc");
+	}
+	struct rule_change * r = &queue[queue_count++];
+	r->change = change;
+	r->c_arg = c_arg;
+	r->protocol = protocol;
+	r->public_port = public_port;
+	r->client = client;
+	r->private_port = private_port;
+	return 0;
+}
+
+/*
+ * Lookups are answered from a snapshot of the nat table, which is read with
+ * iptables -S once and then kept up to date with the changes made by this
+ * backend. It gets read again after dnat_reload() or after a failed commit.
+ * Rules with a port range are only indexed by public port, since they don't
+ * map a single private port.
+ */
+
+#define NO_RULE UINT32_MAX
+/* most ports a multiport match takes, a range counts as two */
+#define MULTIPORT_MAXSIZE 15
+#define CLIENT_HASH_SIZE 4096
+
+/* a DNAT rule in the snapshot, ports are in host byte order except private_port */
+struct snapshot_rule {
+	/* 0 if the rule is in the free list */
+	char used;
+	char protocol;
+	/* a rule not in our chain or with a port range must not get destroyed */
+	char manual;
+	uint16_t port_low;
+	uint16_t port_high;
+	uint32_t client;
+	/* 0 if the destination has no port */
+	uint16_t private_port;
+	/* next rule with the same hash of client and private port, or in the free list */
+	uint32_t hash_next;
+};
+
+/* the rules of the snapshot, unused ones are in a free list */
+static struct snapshot_rule * rules = NULL;
+static uint32_t rules_size = 0;
+static uint32_t rules_free = NO_RULE;
+/* rule covering a public port for every protocol */
+static uint32_t by_port[2][UINT16_MAX + 1];
+/* chains of rules by client and private port */
+static uint32_t by_client[CLIENT_HASH_SIZE];
+/* set if the snapshot needs to be read again */
+static int snapshot_stale = 1;
+
+static uint32_t client_hash(const char protocol, const uint32_t client, const uint16_t private_port) {
+	return ((client ^ ((uint32_t) private_port << 16) ^ protocol) * 2654435761u) >> 20;
+}
+
+/* function that adds a rule to the snapshot and its indexes */
+static void add_rule(const char protocol, const uint16_t port_low, const uint16_t port_high, const uint32_t client, const uint16_t private_port, const char manual) {
+	if (rules_free == NO_RULE) {
+		uint32_t i, old_size = rules_size;
+		rules_size = (rules_size) ? rules_size * 2 : 256;
+		rules = realloc(rules, rules_size * sizeof(*rules));
+		if (rules == NULL) p_die("realloc");
+		for (i = rules_size; i > old_size; i--) {
+			rules[i - 1].used = 0;
+			rules[i - 1].hash_next = rules_free;
+			rules_free = i - 1;
+		}
+	}
+	uint32_t i = rules_free;
+	struct snapshot_rule * r = &rules[i];
+	rules_free = r->hash_next;
+	r->used = 1;
+	r->protocol = protocol;
+	r->manual = manual || port_low != port_high;
+	r->port_low = port_low;
+	r->port_high = port_high;
+	r->client = client;
+	r->private_port = private_port;
+	r->hash_next = NO_RULE;
+
+	/* the first matching rule wins, as in iptables */
+	uint32_t port;
+	for (port = port_low; port <= port_high; port++) {
+		if (by_port[protocol - 1][port] == NO_RULE) by_port[protocol - 1][port] = i;
+	}
+	if (port_low == port_high && private_port) {
+		uint32_t h = client_hash(protocol, client, private_port);
+		r->hash_next = by_client[h];
+		by_client[h] = i;
+	}
+}
+
+/* function that removes a rule with a single port from the snapshot */
+static void remove_rule(const uint32_t i) {
+	struct snapshot_rule * r = &rules[i];
+	if (by_port[r->protocol - 1][r->port_low] == i) by_port[r->protocol - 1][r->port_low] = NO_RULE;
+	if (r->private_port) {
+		uint32_t * p = &by_client[client_hash(r->protocol, r->client, r->private_port)];
+		while (*p != i) p = &rules[*p].hash_next;
+		*p = r->hash_next;
+	}
+	r->used = 0;
+	r->hash_next = rules_free;
+	rules_free = i;
+}
+
+/* function that searches the rule for a client and private port */
+static uint32_t find_rule_by_client(const char protocol, const uint32_t client, const uint16_t private_port) {
+	uint32_t i;
+	for (i = by_client[client_hash(protocol, client, private_port)]; i != NO_RULE; i = rules[i].hash_next) {
+		if (rules[i].protocol == protocol && rules[i].client == client && rules[i].private_port == private_port) return i;
+	}
+	return NO_RULE;
+}
+
+/* function that searches a rule of our chain with a single public port, client and private port */
+static uint32_t find_own_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	uint32_t i;
+	for (i = by_client[client_hash(protocol, client, private_port)]; i != NO_RULE; i = rules[i].hash_next) {
+		if (rules[i].protocol == protocol && rules[i].client == client && rules[i].private_port == private_port &&
+				rules[i].port_low == public_port && !rules[i].manual) return i;
+	}
+	return NO_RULE;
+}
+
+/* function that parses a rule as printed by iptables -S and adds it to the snapshot if it is a DNAT rule */
+static void parse_rule(char * line) {
+	char * chain = NULL;
+	char protocol = 0;
+	char dnat = 0;
+	/* the destination ports matched, a single one or range, or a multiport list */
+	uint16_t port_low[MULTIPORT_MAXSIZE], port_high[MULTIPORT_MAXSIZE];
+	int port_c = 0;
+	char multiport = 0;
+	char * destination = NULL;
+
+	char * save;
+	char * arg = strtok_r(line, " \n", &save);
+	if (arg == NULL || strcmp(arg, "-A") != 0) return;
+	chain = strtok_r(NULL, " \n", &save);
+	if (chain == NULL) return;
+	while ((arg = strtok_r(NULL, " \n", &save)) != NULL) {
+		char * value = strtok_r(NULL, " \n", &save);
+		if (value == NULL) break;
+		if (strcmp(arg, "-p") == 0) {
+			if (strcmp(value, "udp") == 0) protocol = UDP;
+			else if (strcmp(value, "tcp") == 0) protocol = TCP;
+			else return;
+		}
+		else if (strcmp(arg, "--dport") == 0 || strcmp(arg, "--dports") == 0) {
+			/* a list of ports and ranges with multiport, else a single one */
+			multiport = (arg[7] == 's');
+			char * save_port;
+			char * range;
+			port_c = 0;
+			for (range = strtok_r(value, ",", &save_port); range != NULL; range = strtok_r(NULL, ",", &save_port)) {
+				if (port_c == MULTIPORT_MAXSIZE) return;
+				char * colon = strchr(range, ':');
+				port_low[port_c] = atoi(range);
+				port_high[port_c] = (colon) ? atoi(colon + 1) : port_low[port_c];
+				if (port_low[port_c] > port_high[port_c]) return;
+				port_c++;
+			}
+		}
+		else if (strcmp(arg, "-j") == 0) dnat = (strcmp(value, "DNAT") == 0);
+		else if (strcmp(arg, "--to-destination") == 0) destination = value;
+		/* options without a value */
+		else if (arg[0] == '!' || strcmp(arg, "--random") == 0 || strcmp(arg, "--persistent") == 0) return;
+	}
+	if (!dnat || destination == NULL) return;
+	if (port_c == 0) {
+		/* without destination ports it can't be found by port, e.g. if it only matches on -d */
+		debug_printf("Ignoring DNAT rule in chain %s without destination ports\n", chain);
+		return;
+	}
+
+	/* destination is address[-address][:port[-port]] */
+	uint16_t private_port = 0;
+	char * colon = strchr(destination, ':');
+	if (colon) {
+		*colon = '\0';
+		private_port = htons(atoi(colon + 1));
+	}
+	char * dash = strchr(destination, '-');
+	if (dash) *dash = '\0';
+	struct in_addr client;
+	if (inet_aton(destination, &client) == 0) return;
+
+	char manual = (strcmp(chain, chain_name) != 0 || multiport);
+	int i;
+	for (i = 0; i < port_c; i++) {
+		if (protocol == 0 || protocol == UDP) add_rule(UDP, port_low[i], port_high[i], client.s_addr, private_port, manual);
+		if (protocol == 0 || protocol == TCP) add_rule(TCP, port_low[i], port_high[i], client.s_addr, private_port, manual);
+	}
+}
+
+/* function that reads the nat table into the snapshot, return 0 on success and -1 on failure */
+static int load_snapshot() {
+	debug_printf("Executing: " IPTABLES_BIN " -t nat -S\n");
+	FILE * p = popen(IPTABLES_BIN " -t nat -S", "r");
+	if (p == NULL) return -1;
+
+	uint32_t i;
+	for (i = 0; i < rules_size; i++) {
+		rules[i].used = 0;
+		rules[i].hash_next = (i + 1 < rules_size) ? i + 1 : NO_RULE;
+	}
+	rules_free = (rules_size) ? 0 : NO_RULE;
+	memset(by_port, 0xff, sizeof(by_port));
+	memset(by_client, 0xff, sizeof(by_client));
+
+	char line[512];
+	while (fgets(line, sizeof(line), p) != NULL) parse_rule(line);
+	if (pclose(p) != 0) return -1;
+	snapshot_stale = 0;
+	return 0;
+}
+
+/* function that reads the snapshot again if needed, but not while changes are queued,
+ * lookups may call it while dnat_commit() runs */
+static int refresh_snapshot() {
+	if (__atomic_load_n(&queue_count, __ATOMIC_ACQUIRE) || !snapshot_stale) return 0;
+	return load_snapshot();
+}
+
+/* function that prints the nat rule of a rule change in iptables syntax */
+static int print_nat_rule(char * buf, const size_t len, const struct rule_change * r) {
 	struct in_addr client_addr;
-	client_addr.s_addr = client;
+	client_addr.s_addr = r->client;
+	return snprintf(buf, len, "-%c %s -p %s --dport %d -j DNAT --to-destination %s:%d",
+			r->c_arg, chain_name, proto(r->protocol), ntohs(r->public_port), inet_ntoa(client_addr), ntohs(r->private_port));
+}
 
-	snprintf(command, sizeof(command),
-			IPTABLES_BIN " -t nat -%c %s -p %s --dport %d -j DNAT --to-destination %s:%d",
-			c_arg, chain_name, proto(protocol), ntohs(public_port), inet_ntoa(client_addr), ntohs(private_port));
-	if (call_executable(command) < 0) return -1;
+#ifdef IPTABLES_CREATEFILTERRULE
+/* function that prints the filter rule of a rule change in iptables syntax */
+static int print_filter_rule(char * buf, const size_t len, const struct rule_change * r) {
+	struct in_addr client_addr;
+	client_addr.s_addr = r->client;
+	return snprintf(buf, len, "-%c %s -p %s --dport %d -d %s -j ACCEPT",
+			r->c_arg, chain_name, proto(r->protocol), ntohs(r->private_port), inet_ntoa(client_addr));
+}
+#endif
+
+/* function that applies all queued rule changes with a single iptables-restore
+ * run, the changes of a table get applied atomically, returns 0 on success */
+static int commit_restore() {
+	char line[256];
+	debug_printf("Executing: " IPTABLES_RESTORE_BIN " --noflush with %zu rule changes\n", queue_count);
+	FILE * p = popen(IPTABLES_RESTORE_BIN " --noflush", "w");
+	if (p == NULL) return -1;
+
+	size_t i;
+	fprintf(p, "*nat\n");
+	for (i = 0; i < queue_count; i++) {
+		print_nat_rule(line, sizeof(line), &queue[i]);
+		fprintf(p, "%s\n", line);
+	}
+	fprintf(p, "COMMIT\n");
 
 	// TODO: make this run-time configurable
 #ifdef IPTABLES_CREATEFILTERRULE
-	snprintf(command, sizeof(command),
-			IPTABLES_BIN " -t filter -%c %s -p %s --dport %d -d %s -j ACCEPT",
-			c_arg, chain_name, proto(protocol), ntohs(private_port), inet_ntoa(client_addr));
-	if (call_executable(command) < 0) return -1;
+	fprintf(p, "*filter\n");
+	for (i = 0; i < queue_count; i++) {
+		print_filter_rule(line, sizeof(line), &queue[i]);
+		fprintf(p, "%s\n", line);
+	}
+	fprintf(p, "COMMIT\n");
 #endif
 
-	return 0;
+	return (pclose(p) == 0) ? 0 : -1;
+}
+
+/* function that applies the queued rule changes one by one, used when the
+ * batch failed, e.g. because one of the rules to delete has already gone,
+ * calls failed() for every rule which could not be created */
+static int commit_single(void (*failed)(const uint32_t change)) {
+	char command[256];
+	int ret = 0;
+	size_t i;
+	for (i = 0; i < queue_count; i++) {
+		int len = snprintf(command, sizeof(command), IPTABLES_BIN " -t nat ");
+		print_nat_rule(command + len, sizeof(command) - len, &queue[i]);
+		int err = call_executable(command);
+
+#ifdef IPTABLES_CREATEFILTERRULE
+		len = snprintf(command, sizeof(command), IPTABLES_BIN " -t filter ");
+		print_filter_rule(command + len, sizeof(command) - len, &queue[i]);
+		if (call_executable(command) != 0) err = -1;
+#endif
+		/* a rule to delete which is not there counts as deleted */
+		if (err != 0 && queue[i].c_arg == 'A') {
+			failed(queue[i].change);
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+/* apply all rule changes queued since the last commit, return 0 on success and -1 on failure */
+static int dnat_commit(void (*failed)(const uint32_t change)) {
+	if (queue_count == 0) return 0;
+	int err = 0;
+	if (commit_restore() != 0) {
+		debug_printf("Batch failed, applying rule changes one by one\n");
+		err = commit_single(failed);
+		/* some of the changes may have failed, don't trust the snapshot */
+		snapshot_stale = 1;
+	}
+	/* lookups see the stale snapshot together with the empty queue */
+	__atomic_store_n(&queue_count, 0, __ATOMIC_RELEASE);
+	return err;
 }
 
 /* search DNAT rule for given public port, return 1 if found, 0 if not found and -1 on error, set client and private_port if not NULL */
-int get_dnat_rule_by_public_port(const char protocol __attribute__ ((unused)), const uint16_t public_port __attribute__ ((unused)), uint32_t * client __attribute__ ((unused)), uint16_t * private_port __attribute__ ((unused))) {
-	return 0;
+static int get_dnat_rule_by_public_port(const char protocol, const uint16_t public_port, uint32_t * client, uint16_t * private_port) {
+	if (refresh_snapshot() == -1) return -1;
+	uint32_t i = by_port[protocol - 1][ntohs(public_port)];
+	if (i == NO_RULE) return 0;
+	if (client) *client = rules[i].client;
+	if (private_port) *private_port = (rules[i].private_port) ? rules[i].private_port : public_port;
+	return 1;
 }
 
 /* search DNAT rule for given private port and client, return 1 if found, 0 if not found and -1 on error, set public_port if not NULL */
-int get_dnat_rule_by_client_port(const char protocol __attribute__ ((unused)), uint16_t * public_port __attribute__ ((unused)), const uint32_t client __attribute__ ((unused)), const uint16_t private_port __attribute__ ((unused))) {
+static int get_dnat_rule_by_client_port(const char protocol, uint16_t * public_port, const uint32_t client, const uint16_t private_port) {
+	if (refresh_snapshot() == -1) return -1;
+	uint32_t i = find_rule_by_client(protocol, client, private_port);
+	if (i == NO_RULE) return 0;
+	if (public_port) *public_port = htons(rules[i].port_low);
+	return 1;
+}
+
+/* create a DNAT rule with given public port, client ip address and private port, return 0 on success and -1 on failure, the rule gets queued until dnat_commit() */
+static int create_dnat_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	uint32_t change = changes++;
+	if (refresh_snapshot() == -1) return -1;
+	uint32_t i = by_port[protocol - 1][ntohs(public_port)];
+	/* the rule is already there */
+	if (i != NO_RULE && rules[i].client == client && rules[i].private_port == private_port) return 0;
+	add_rule(protocol, ntohs(public_port), ntohs(public_port), client, private_port, 0);
+	return change_dnat_rule(change, 'A', protocol, public_port, client, private_port);
+}
+
+/* destroy a DNAT rule with given public port, client ip address and private port, return 0 on success, 1 when forbidden and -1 on failure, the rule gets queued until dnat_commit() */
+static int destroy_dnat_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	uint32_t change = changes++;
+	if (refresh_snapshot() == -1) return -1;
+	uint32_t i = by_port[protocol - 1][ntohs(public_port)];
+	/* rules with a port range or in other chains are not ours */
+	if (i != NO_RULE && rules[i].manual) return 1;
+	/* deleting a rule which is not there would fail the whole batch */
+	i = find_own_rule(protocol, ntohs(public_port), client, private_port);
+	if (i == NO_RULE) return 0;
+	remove_rule(i);
+	return change_dnat_rule(change, 'D', protocol, public_port, client, private_port);
+}
+
+/* call found() for every rule in our chain, taken from the snapshot */
+static int list_dnat_rules(void (*found)(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port)) {
+	if (refresh_snapshot() == -1) return -1;
+	char protocol;
+	uint32_t port;
+	for (protocol = UDP; protocol <= TCP; protocol++) {
+		for (port = 0; port <= UINT16_MAX; port++) {
+			uint32_t i = by_port[protocol - 1][port];
+			if (i == NO_RULE || rules[i].manual || rules[i].port_low != port || rules[i].private_port == 0) continue;
+			found(protocol, htons(port), rules[i].client, rules[i].private_port);
+		}
+	}
+	return 0;
+}
+
+/* call taken() for the ports of every DNAT rule in the snapshot */
+static int list_dnat_ports(void (*taken)(const char protocol, const uint16_t port_low, const uint16_t port_high)) {
+	if (refresh_snapshot() == -1) return -1;
+	uint32_t i;
+	for (i = 0; i < rules_size; i++) {
+		if (rules[i].used) taken(rules[i].protocol, htons(rules[i].port_low), htons(rules[i].port_high));
+	}
 	return 0;
 }
 
-/* create a DNAT rule with given public port, client ip address and private port, return 0 on success and -1 on failure */
-int create_dnat_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
-	return change_dnat_rule('A', protocol, public_port, client, private_port);
+/* forget the snapshot of the nat table, it gets read again when needed */
+static void dnat_reload() {
+	debug_printf("Reloading iptables nat table on next lookup\n");
+	snapshot_stale = 1;
 }
 
-/* destroy a DNAT rule with given public port, client ip address and private port, return 0 on success, 1 when forbidden and -1 on failure */
-int destroy_dnat_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
-	return change_dnat_rule('D', protocol, public_port, client, private_port);
+/* the queue of rule changes is the transaction */
+static int dnat_begin() {
+	changes = 0;
+	return 0;
 }
+
+const struct dnat_backend linux_iptables_backend = {
+	.name = "iptables",
+	.init = dnat_init,
+	.get_rule_by_public_port = get_dnat_rule_by_public_port,
+	.get_rule_by_client_port = get_dnat_rule_by_client_port,
+	.begin = dnat_begin,
+	.create_rule = create_dnat_rule,
+	.destroy_rule = destroy_dnat_rule,
+	.commit = dnat_commit,
+	.reload = dnat_reload,
+	.list_rules = list_dnat_rules,
+	.list_ports = list_dnat_ports,
+};
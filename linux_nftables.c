@@ -0,0 +1,558 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "dnat_api.h"
+#include "die.h"
+
+
+#define TABLE_NAME_MAXSIZE 30
+#define DEFAULT_TABLE_NAME "natpmp"
+#define MAP_NAME "fwd"
+#define CHAIN_NAME "prerouting"
+#define MAP_ID 1
+
+/* nftables data type ids, used by nft for printing the map */
+#define TYPE_BITS 6
+#define TYPE_IPADDR 7
+#define TYPE_INET_PROTOCOL 12
+#define TYPE_INET_SERVICE 13
+
+/* maximal size of a batch sent to the kernel, longer queues are split */
+#define BATCH_MAXSIZE 32768
+
+/*
+ * All mappings are elements of one map in the table given as backend option:
+ *
+ *   table ip natpmp {
+ *     map fwd {
+ *       type inet_proto . inet_service : ipv4_addr . inet_service
+ *     }
+ *     chain prerouting {
+ *       type nat hook prerouting priority dstnat;
+ *       dnat ip to meta l4proto . th dport map @fwd
+ *     }
+ *   }
+ *
+ * The table, the map and the chain get created by dnat_init(), elements of
+ * the map are kept. Mapping lookups cost the same for any number of leases
+ * and changes are sent over netlink without executing anything. Since the
+ * map only holds mappings created by this program, there are no manual
+ * mappings to report.
+ */
+
+char table_name[32] = DEFAULT_TABLE_NAME;
+
+/* netlink socket to the nftables subsystem */
+static int nl_fd = -1;
+static uint32_t nl_seq = 0;
+
+/* buffer a batch of netlink messages is built in */
+static char batch[BATCH_MAXSIZE];
+static size_t batch_len = 0;
+/* sequence number of the first message and offset of the last message of the batch */
+static uint32_t batch_first_seq;
+static size_t batch_last_msg;
+
+/* a map element change waiting for dnat_commit() */
+struct elem_change {
+	uint16_t msg_type;
+	char protocol;
+	uint16_t public_port;
+	uint32_t client;
+	uint16_t private_port;
+};
+
+/* queue of element changes, grows as needed and is reused after every commit */
+static struct elem_change * queue = NULL;
+static size_t queue_size = 0;
+static size_t queue_count = 0;
+
+/* function that starts a netlink message in the batch */
+static struct nlmsghdr * msg_begin(const uint16_t type, const uint16_t flags, const uint16_t res_id) {
+	struct nlmsghdr * nlh = (struct nlmsghdr *) (batch + batch_len);
+	memset(nlh, 0, NLMSG_HDRLEN + sizeof(struct nfgenmsg));
+	nlh->nlmsg_len = NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(struct nfgenmsg));
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+	nlh->nlmsg_seq = ++nl_seq;
+	struct nfgenmsg * nfg = NLMSG_DATA(nlh);
+	nfg->nfgen_family = NFPROTO_IPV4;
+	nfg->version = NFNETLINK_V0;
+	nfg->res_id = htons(res_id);
+	return nlh;
+}
+
+/* function that finishes a netlink message in the batch */
+static void msg_end(struct nlmsghdr * nlh) {
+	batch_last_msg = (char *) nlh - batch;
+	batch_len += NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+/* function that starts a nftables message */
+static struct nlmsghdr * nft_msg_begin(const uint16_t type, const uint16_t flags) {
+	return msg_begin((NFNL_SUBSYS_NFTABLES << 8) | type, flags, 0);
+}
+
+/* function that appends an attribute to a netlink message */
+static struct nlattr * attr_put(struct nlmsghdr * nlh, const uint16_t type, const void * data, const size_t len) {
+	struct nlattr * nla = (struct nlattr *) ((char *) nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	if (len) memcpy((char *) nla + NLA_HDRLEN, data, len);
+	memset((char *) nla + nla->nla_len, 0, NLA_ALIGN(nla->nla_len) - nla->nla_len);
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+	return nla;
+}
+
+static void attr_put_u32(struct nlmsghdr * nlh, const uint16_t type, const uint32_t value) {
+	uint32_t v = htonl(value);
+	attr_put(nlh, type, &v, sizeof(v));
+}
+
+static void attr_put_str(struct nlmsghdr * nlh, const uint16_t type, const char * s) {
+	attr_put(nlh, type, s, strlen(s) + 1);
+}
+
+/* functions that open and close a nested attribute */
+static struct nlattr * nest_begin(struct nlmsghdr * nlh, const uint16_t type) {
+	return attr_put(nlh, NLA_F_NESTED | type, NULL, 0);
+}
+
+static void nest_end(struct nlmsghdr * nlh, struct nlattr * nest) {
+	nest->nla_len = (char *) nlh + nlh->nlmsg_len - (char *) nest;
+}
+
+/* function that starts a new batch */
+static void batch_begin() {
+	batch_len = 0;
+	msg_end(msg_begin(NFNL_MSG_BATCH_BEGIN, 0, NFNL_SUBSYS_NFTABLES));
+	batch_first_seq = nl_seq;
+}
+
+/* function that sends the batch and waits until it is processed, returns 0
+ * on success and the negative errno of the first failed message otherwise,
+ * the whole batch gets rolled back by the kernel if one message fails */
+static int batch_send() {
+	/* only the last message gets acknowledged, failed ones get reported
+	 * anyway, so the replies of big batches don't overflow the socket */
+	struct nlmsghdr * last = (struct nlmsghdr *) (batch + batch_last_msg);
+	last->nlmsg_flags |= NLM_F_ACK;
+	uint32_t last_seq = last->nlmsg_seq;
+	msg_end(msg_begin(NFNL_MSG_BATCH_END, 0, NFNL_SUBSYS_NFTABLES));
+
+	struct sockaddr_nl kernel;
+	memset(&kernel, 0, sizeof(kernel));
+	kernel.nl_family = AF_NETLINK;
+	if (sendto(nl_fd, batch, batch_len, 0, (struct sockaddr *) &kernel, sizeof(kernel)) == -1) p_die("sendto");
+
+	int err = 0;
+	while (1) {
+		char buf[8192];
+		ssize_t len = recv(nl_fd, buf, sizeof(buf), 0);
+		if (len == -1) {
+			if (errno == EINTR) continue;
+			p_die("recv");
+		}
+		struct nlmsghdr * nlh;
+		for (nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type != NLMSG_ERROR) continue;
+			struct nlmsgerr * e = NLMSG_DATA(nlh);
+			if (e->error && err == 0) err = e->error;
+			/* the last message got answered or the batch got refused as whole */
+			if (nlh->nlmsg_seq == last_seq || (e->error && nlh->nlmsg_seq == batch_first_seq)) return err;
+		}
+	}
+}
+
+/* function that appends a message changing a map element to the batch */
+static void put_elem_change(const struct elem_change * c) {
+	struct nlmsghdr * nlh = nft_msg_begin(c->msg_type, (c->msg_type == NFT_MSG_NEWSETELEM) ? NLM_F_CREATE : 0);
+	attr_put_str(nlh, NFTA_SET_ELEM_LIST_TABLE, table_name);
+	attr_put_str(nlh, NFTA_SET_ELEM_LIST_SET, MAP_NAME);
+	struct nlattr * elements = nest_begin(nlh, NFTA_SET_ELEM_LIST_ELEMENTS);
+	struct nlattr * element = nest_begin(nlh, NFTA_LIST_ELEM);
+
+	/* the fields of concatenations are padded to 32 bit */
+	uint8_t key[8];
+	memset(key, 0, sizeof(key));
+	key[0] = (c->protocol == UDP) ? IPPROTO_UDP : IPPROTO_TCP;
+	memcpy(&key[4], &c->public_port, sizeof(c->public_port));
+	struct nlattr * nest = nest_begin(nlh, NFTA_SET_ELEM_KEY);
+	attr_put(nlh, NFTA_DATA_VALUE, key, sizeof(key));
+	nest_end(nlh, nest);
+
+	if (c->msg_type == NFT_MSG_NEWSETELEM) {
+		uint8_t data[8];
+		memset(data, 0, sizeof(data));
+		memcpy(&data[0], &c->client, sizeof(c->client));
+		memcpy(&data[4], &c->private_port, sizeof(c->private_port));
+		nest = nest_begin(nlh, NFTA_SET_ELEM_DATA);
+		attr_put(nlh, NFTA_DATA_VALUE, data, sizeof(data));
+		nest_end(nlh, nest);
+	}
+
+	nest_end(nlh, element);
+	nest_end(nlh, elements);
+	msg_end(nlh);
+}
+
+/* function that appends an expression to a rule */
+static struct nlattr * expr_begin(struct nlmsghdr * nlh, const char * name) {
+	struct nlattr * elem = nest_begin(nlh, NFTA_LIST_ELEM);
+	attr_put_str(nlh, NFTA_EXPR_NAME, name);
+	nest_begin(nlh, NFTA_EXPR_DATA);
+	return elem;
+}
+
+static void expr_end(struct nlmsghdr * nlh, struct nlattr * elem) {
+	/* the data attribute directly follows the name attribute */
+	struct nlattr * name = (struct nlattr *) ((char *) elem + NLA_HDRLEN);
+	nest_end(nlh, (struct nlattr *) ((char *) name + NLA_ALIGN(name->nla_len)));
+	nest_end(nlh, elem);
+}
+
+/* function that creates the table, the map and the chain with its only rule */
+static void setup_table() {
+	struct nlmsghdr * nlh;
+	struct nlattr * nest;
+	batch_begin();
+
+	nlh = nft_msg_begin(NFT_MSG_NEWTABLE, NLM_F_CREATE);
+	attr_put_str(nlh, NFTA_TABLE_NAME, table_name);
+	msg_end(nlh);
+
+	nlh = nft_msg_begin(NFT_MSG_NEWSET, NLM_F_CREATE);
+	attr_put_str(nlh, NFTA_SET_TABLE, table_name);
+	attr_put_str(nlh, NFTA_SET_NAME, MAP_NAME);
+	attr_put_u32(nlh, NFTA_SET_ID, MAP_ID);
+	attr_put_u32(nlh, NFTA_SET_FLAGS, NFT_SET_MAP);
+	attr_put_u32(nlh, NFTA_SET_KEY_TYPE, TYPE_INET_PROTOCOL << TYPE_BITS | TYPE_INET_SERVICE);
+	attr_put_u32(nlh, NFTA_SET_KEY_LEN, 8);
+	attr_put_u32(nlh, NFTA_SET_DATA_TYPE, TYPE_IPADDR << TYPE_BITS | TYPE_INET_SERVICE);
+	attr_put_u32(nlh, NFTA_SET_DATA_LEN, 8);
+	msg_end(nlh);
+
+	nlh = nft_msg_begin(NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+	attr_put_str(nlh, NFTA_CHAIN_TABLE, table_name);
+	attr_put_str(nlh, NFTA_CHAIN_NAME, CHAIN_NAME);
+	nest = nest_begin(nlh, NFTA_CHAIN_HOOK);
+	attr_put_u32(nlh, NFTA_HOOK_HOOKNUM, NF_INET_PRE_ROUTING);
+	attr_put_u32(nlh, NFTA_HOOK_PRIORITY, (uint32_t) -100); /* dstnat */
+	nest_end(nlh, nest);
+	attr_put_str(nlh, NFTA_CHAIN_TYPE, "nat");
+	msg_end(nlh);
+
+	/* flush the chain, so the rule doesn't get added twice on restarts */
+	nlh = nft_msg_begin(NFT_MSG_DELRULE, 0);
+	attr_put_str(nlh, NFTA_RULE_TABLE, table_name);
+	attr_put_str(nlh, NFTA_RULE_CHAIN, CHAIN_NAME);
+	msg_end(nlh);
+
+	/* dnat ip to meta l4proto . th dport map @fwd */
+	nlh = nft_msg_begin(NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND);
+	attr_put_str(nlh, NFTA_RULE_TABLE, table_name);
+	attr_put_str(nlh, NFTA_RULE_CHAIN, CHAIN_NAME);
+	nest = nest_begin(nlh, NFTA_RULE_EXPRESSIONS);
+	{
+		struct nlattr * e;
+		e = expr_begin(nlh, "meta");
+		attr_put_u32(nlh, NFTA_META_KEY, NFT_META_L4PROTO);
+		attr_put_u32(nlh, NFTA_META_DREG, NFT_REG32_00);
+		expr_end(nlh, e);
+
+		e = expr_begin(nlh, "payload");
+		attr_put_u32(nlh, NFTA_PAYLOAD_DREG, NFT_REG32_01);
+		attr_put_u32(nlh, NFTA_PAYLOAD_BASE, NFT_PAYLOAD_TRANSPORT_HEADER);
+		attr_put_u32(nlh, NFTA_PAYLOAD_OFFSET, 2);
+		attr_put_u32(nlh, NFTA_PAYLOAD_LEN, 2);
+		expr_end(nlh, e);
+
+		e = expr_begin(nlh, "lookup");
+		attr_put_str(nlh, NFTA_LOOKUP_SET, MAP_NAME);
+		attr_put_u32(nlh, NFTA_LOOKUP_SET_ID, MAP_ID);
+		attr_put_u32(nlh, NFTA_LOOKUP_SREG, NFT_REG32_00);
+		attr_put_u32(nlh, NFTA_LOOKUP_DREG, NFT_REG32_00);
+		expr_end(nlh, e);
+
+		e = expr_begin(nlh, "nat");
+		attr_put_u32(nlh, NFTA_NAT_TYPE, NFT_NAT_DNAT);
+		attr_put_u32(nlh, NFTA_NAT_FAMILY, NFPROTO_IPV4);
+		attr_put_u32(nlh, NFTA_NAT_REG_ADDR_MIN, NFT_REG32_00);
+		attr_put_u32(nlh, NFTA_NAT_REG_PROTO_MIN, NFT_REG32_01);
+		expr_end(nlh, e);
+	}
+	nest_end(nlh, nest);
+	msg_end(nlh);
+
+	int err = batch_send();
+	if (err) {
+		errno = -err;
+		p_die("nftables setup");
+	}
+}
+
+static void dnat_init(int argc, char * argv[]) {
+	if (argc > 1) die("Give only name of nftables table as backend option.");
+	if (argc == 1) {
+		if (*argv[0] == '\0') die("Backend option is a very little bit too short.");
+		if (strlen(argv[0]) > TABLE_NAME_MAXSIZE) die("Backend option is too long.");
+		strncpy(table_name, argv[0], sizeof(table_name));
+	}
+	debug_printf("Using nftables table: %s\n", table_name);
+
+	nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+	if (nl_fd == -1) p_die("socket");
+	struct sockaddr_nl local;
+	memset(&local, 0, sizeof(local));
+	local.nl_family = AF_NETLINK;
+	if (bind(nl_fd, (struct sockaddr *) &local, sizeof(local)) == -1) p_die("bind");
+	/* don't get the whole request echoed in every acknowledgement */
+	int one = 1;
+	setsockopt(nl_fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+	/* make room for an error of every message of a failed batch */
+	int rcvbuf = 1 << 20;
+	if (setsockopt(nl_fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) == -1)
+		setsockopt(nl_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	setup_table();
+}
+
+/* search DNAT rule for given public port, return 1 if found, 0 if not found and -1 on error, set client and private_port if not NULL */
+static int get_dnat_rule_by_public_port(const char protocol __attribute__ ((unused)), const uint16_t public_port __attribute__ ((unused)), uint32_t * client __attribute__ ((unused)), uint16_t * private_port __attribute__ ((unused))) {
+	return 0;
+}
+
+/* search DNAT rule for given private port and client, return 1 if found, 0 if not found and -1 on error, set public_port if not NULL */
+static int get_dnat_rule_by_client_port(const char protocol __attribute__ ((unused)), uint16_t * public_port __attribute__ ((unused)), const uint32_t client __attribute__ ((unused)), const uint16_t private_port __attribute__ ((unused))) {
+	return 0;
+}
+
+/* function that gets wrapped by create_dnat_rule() and destroy_dnat_rule() */
+static int change_dnat_rule(const uint16_t msg_type, const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	if (queue_count == queue_size) {
+		queue_size = (queue_size) ? queue_size * 2 : 64;
+		queue = realloc(queue, queue_size * sizeof(*queue));
+		if (queue == NULL) p_die("realloc");
+	}
+	struct elem_change * c = &queue[queue_count++];
+	c->msg_type = msg_type;
+	c->protocol = protocol;
+	c->public_port = public_port;
+	c->client = client;
+	c->private_port = private_port;
+	return 0;
+}
+
+/* create a DNAT rule with given public port, client ip address and private port, return 0 on success and -1 on failure, the rule gets queued until dnat_commit() */
+static int create_dnat_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	return change_dnat_rule(NFT_MSG_NEWSETELEM, protocol, public_port, client, private_port);
+}
+
+/* destroy a DNAT rule with given public port, client ip address and private port, return 0 on success, 1 when forbidden and -1 on failure, the rule gets queued until dnat_commit() */
+static int destroy_dnat_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	return change_dnat_rule(NFT_MSG_DELSETELEM, protocol, public_port, client, private_port);
+}
+
+/* function that applies a single element change, used when a batch failed,
+ * e.g. because an element to delete has already gone or an element to create
+ * still exists with an other destination */
+static int commit_single(const struct elem_change * c) {
+	batch_begin();
+	put_elem_change(c);
+	int err = batch_send();
+	if (c->msg_type == NFT_MSG_DELSETELEM && err == -ENOENT) return 0;
+	if (c->msg_type == NFT_MSG_NEWSETELEM && (err == -EEXIST || err == -EBUSY)) {
+		struct elem_change d = *c;
+		d.msg_type = NFT_MSG_DELSETELEM;
+		batch_begin();
+		put_elem_change(&d);
+		put_elem_change(c);
+		err = batch_send();
+	}
+	if (err) {
+		errno = -err;
+		perror("nftables");
+		return -1;
+	}
+	return 0;
+}
+
+/* function that returns the first nested attribute of an attribute */
+static struct nlattr * attr_first(const struct nlattr * nest, int * len) {
+	*len = nest->nla_len - NLA_HDRLEN;
+	return (struct nlattr *) ((char *) nest + NLA_HDRLEN);
+}
+
+static int attr_ok(const struct nlattr * nla, const int len) {
+	return len >= (int) sizeof(*nla) && nla->nla_len >= sizeof(*nla) && nla->nla_len <= len;
+}
+
+static struct nlattr * attr_next(const struct nlattr * nla, int * len) {
+	*len -= NLA_ALIGN(nla->nla_len);
+	return (struct nlattr *) ((char *) nla + NLA_ALIGN(nla->nla_len));
+}
+
+/* function that returns the value of the NFTA_DATA_VALUE attribute nested in nest, NULL if it has not the given length */
+static const uint8_t * data_value(const struct nlattr * nest, const size_t size) {
+	int len;
+	struct nlattr * nla;
+	for (nla = attr_first(nest, &len); attr_ok(nla, len); nla = attr_next(nla, &len)) {
+		if ((nla->nla_type & NLA_TYPE_MASK) == NFTA_DATA_VALUE && nla->nla_len == NLA_HDRLEN + size)
+			return (uint8_t *) nla + NLA_HDRLEN;
+	}
+	return NULL;
+}
+
+/* function that calls found() for a map element */
+static void parse_element(const struct nlattr * elem, void (*found)(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port)) {
+	const uint8_t * key = NULL, * data = NULL;
+	int len;
+	struct nlattr * nla;
+	for (nla = attr_first(elem, &len); attr_ok(nla, len); nla = attr_next(nla, &len)) {
+		if ((nla->nla_type & NLA_TYPE_MASK) == NFTA_SET_ELEM_KEY) key = data_value(nla, 8);
+		else if ((nla->nla_type & NLA_TYPE_MASK) == NFTA_SET_ELEM_DATA) data = data_value(nla, 8);
+	}
+	if (key == NULL || data == NULL) return;
+
+	char protocol;
+	if (key[0] == IPPROTO_UDP) protocol = UDP;
+	else if (key[0] == IPPROTO_TCP) protocol = TCP;
+	else return;
+	uint16_t public_port, private_port;
+	uint32_t client;
+	memcpy(&public_port, &key[4], sizeof(public_port));
+	memcpy(&client, &data[0], sizeof(client));
+	memcpy(&private_port, &data[4], sizeof(private_port));
+	found(protocol, public_port, client, private_port);
+}
+
+/* call found() for every element of the map */
+static int list_dnat_rules(void (*found)(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port)) {
+	batch_len = 0;
+	struct nlmsghdr * nlh = msg_begin((NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_GETSETELEM, NLM_F_DUMP, 0);
+	attr_put_str(nlh, NFTA_SET_ELEM_LIST_TABLE, table_name);
+	attr_put_str(nlh, NFTA_SET_ELEM_LIST_SET, MAP_NAME);
+	msg_end(nlh);
+
+	struct sockaddr_nl kernel;
+	memset(&kernel, 0, sizeof(kernel));
+	kernel.nl_family = AF_NETLINK;
+	if (sendto(nl_fd, batch, batch_len, 0, (struct sockaddr *) &kernel, sizeof(kernel)) == -1) p_die("sendto");
+
+	while (1) {
+		static char buf[65536];
+		ssize_t len = recv(nl_fd, buf, sizeof(buf), 0);
+		if (len == -1) {
+			if (errno == EINTR) continue;
+			p_die("recv");
+		}
+		for (nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type == NLMSG_DONE) return 0;
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr * e = NLMSG_DATA(nlh);
+				if (e->error == 0) continue;
+				errno = -e->error;
+				perror("nftables");
+				return -1;
+			}
+
+			/* the attributes follow the nfgenmsg header */
+			int alen = nlh->nlmsg_len - NLMSG_HDRLEN - NLMSG_ALIGN(sizeof(struct nfgenmsg));
+			struct nlattr * nla = (struct nlattr *) ((char *) NLMSG_DATA(nlh) + NLMSG_ALIGN(sizeof(struct nfgenmsg)));
+			for (; attr_ok(nla, alen); nla = attr_next(nla, &alen)) {
+				if ((nla->nla_type & NLA_TYPE_MASK) != NFTA_SET_ELEM_LIST_ELEMENTS) continue;
+				int elen;
+				struct nlattr * elem;
+				for (elem = attr_first(nla, &elen); attr_ok(elem, elen); elem = attr_next(elem, &elen)) {
+					if ((elem->nla_type & NLA_TYPE_MASK) == NFTA_LIST_ELEM) parse_element(elem, found);
+				}
+			}
+		}
+	}
+}
+
+/* all elements of the map are leases of the daemon, whose ports it knows */
+static int list_dnat_ports(void (*taken)(const char protocol, const uint16_t port_low, const uint16_t port_high) __attribute__ ((unused))) {
+	return 0;
+}
+
+/* the map only holds elements of this program, there is nothing to reload */
+static void dnat_reload() {
+}
+
+/* apply all element changes queued since the last commit, return 0 on success and -1 on failure,
+ * every call of create_dnat_rule() and destroy_dnat_rule() queues a change, so its number is its place in the queue */
+static int dnat_commit(void (*failed)(const uint32_t change)) {
+	int ret = 0;
+	size_t i = 0;
+	while (i < queue_count) {
+		/* fill a batch, one message per change */
+		size_t first = i;
+		batch_begin();
+		/* leave room for the biggest message and the end message */
+		while (i < queue_count && batch_len + 512 < sizeof(batch)) {
+			put_elem_change(&queue[i++]);
+		}
+		debug_printf("Sending nftables batch with %zu element changes\n", i - first);
+		if (batch_send() != 0) {
+			debug_printf("Batch failed, applying element changes one by one\n");
+			size_t j;
+			for (j = first; j < i; j++) {
+				if (commit_single(&queue[j]) == -1) {
+					failed(j);
+					ret = -1;
+				}
+			}
+		}
+	}
+	queue_count = 0;
+	return ret;
+}
+
+/* the queue of element changes is the transaction */
+static int dnat_begin() {
+	return 0;
+}
+
+const struct dnat_backend linux_nftables_backend = {
+	.name = "nftables",
+	.init = dnat_init,
+	.get_rule_by_public_port = get_dnat_rule_by_public_port,
+	.get_rule_by_client_port = get_dnat_rule_by_client_port,
+	.begin = dnat_begin,
+	.create_rule = create_dnat_rule,
+	.destroy_rule = destroy_dnat_rule,
+	.commit = dnat_commit,
+	.reload = dnat_reload,
+	.list_rules = list_dnat_rules,
+	.list_ports = list_dnat_ports,
+};
@@ -0,0 +1,663 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dnat_api.h"
+#include "die.h"
+
+
+/*
+ * Instead of letting the kernel rewrite packets, this backend listens on every
+ * mapped public port itself and forwards to the client, for systems without
+ * netfilter. A single thread serves all mappings with epoll. TCP connections
+ * get spliced through a pipe per direction, so the data never gets copied to
+ * userspace. UDP datagrams get forwarded in batches with recvmmsg() and
+ * sendmmsg(), every outside peer gets its own socket to the client, so the
+ * answers can be sent back to it.
+ *
+ * The table of mappings is owned by the helper's thread, which answers the
+ * lookups from it. commit() passes the changes to the epoll thread and waits
+ * until they are applied, ports which could not be opened get reported as
+ * failed changes.
+ */
+
+/* size of the pipes between the sockets of a TCP connection */
+#define PIPE_SIZE 65536
+/* number of datagrams read and sent at once */
+#define UDP_BATCH 32
+#define UDP_BUFSIZE 65536
+/* UDP peers not sending or receiving for this time lose their socket */
+#define UDP_SESSION_TIMEOUT 120 /* s */
+#define SWEEP_INTERVAL 10 /* s */
+#define SESSION_HASH_SIZE 4096
+#define EVENTS_MAXSIZE 64
+
+/* kinds of file descriptors in the epoll set */
+#define EP_WAKEUP 0
+#define EP_LISTENER 1
+#define EP_TCP 2
+#define EP_UDP_PUBLIC 3
+#define EP_UDP_SESSION 4
+
+/* what the data of an epoll event points to */
+struct endpoint {
+	char kind;
+	/* for EP_TCP, which socket of the connection */
+	char side;
+};
+
+struct conn;
+struct session;
+
+/* a mapped public port, owned by the epoll thread */
+struct mapping {
+	struct endpoint ep;
+	int fd;
+	char protocol;
+	uint16_t public_port;
+	struct sockaddr_in destination;
+	struct conn * conns;
+	struct session * sessions;
+};
+
+/* a forwarded TCP connection, side 0 is the outside, side 1 the client */
+struct conn {
+	struct endpoint ep[2];
+	int fd[2];
+	/* pipe of every direction, the direction is the side data is read from */
+	int pipe[2][2];
+	size_t pending[2];
+	char eof[2];
+	/* set when closed, the memory is kept until the events of the batch are handled */
+	char closed;
+	struct mapping * m;
+	struct conn * prev, * next;
+};
+
+/* an outside peer of a UDP mapping with its socket to the client */
+struct session {
+	struct endpoint ep;
+	int fd;
+	struct sockaddr_in peer;
+	time_t last_active;
+	struct mapping * m;
+	struct session * prev, * next;
+	struct session * hash_next;
+};
+
+/* a change of the mappings waiting for commit() */
+struct proxy_change {
+	/* number of the change since begin() */
+	uint32_t change;
+	/* set by the epoll thread if the port could not be opened */
+	char failed;
+	char create;
+	char protocol;
+	uint16_t public_port;
+	uint32_t client;
+	uint16_t private_port;
+};
+
+/* a mapping as seen by the helper's thread */
+struct proxy_rule {
+	uint32_t client;
+	uint16_t private_port;
+	char used;
+};
+
+/* address to listen on */
+static struct in_addr listen_address;
+
+/* table of the mappings, only used by the helper's threads, and by the epoll thread while commit() waits,
+ * which clears used of ports it could not open while lookups may run */
+static struct proxy_rule rules[2][UINT16_MAX + 1];
+
+/* changes waiting for commit() */
+static struct proxy_change * queue = NULL;
+static size_t queue_size = 0;
+static size_t queue_count = 0;
+/* number of create and destroy calls since begin() */
+static uint32_t changes = 0;
+
+/* changes passed to the epoll thread, protected by inbox_lock */
+static pthread_mutex_t inbox_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inbox_done = PTHREAD_COND_INITIALIZER;
+static struct proxy_change * inbox = NULL;
+static size_t inbox_count = 0;
+
+/* everything below is owned by the epoll thread */
+static int epoll_fd = -1;
+static int wakeup_fd = -1;
+static struct endpoint wakeup_ep = { EP_WAKEUP, 0 };
+static struct mapping * mappings[2][UINT16_MAX + 1];
+static struct session * session_hash[SESSION_HASH_SIZE];
+static time_t now;
+/* connections closed while handling a batch of events, linked by next */
+static struct conn * closed_conns = NULL;
+
+/* buffers for UDP batches */
+static char udp_buf[UDP_BATCH][UDP_BUFSIZE];
+static struct mmsghdr udp_msgs[UDP_BATCH];
+static struct iovec udp_iov[UDP_BATCH];
+static struct sockaddr_in udp_addr[UDP_BATCH];
+
+static void epoll_add(const int fd, const uint32_t events, struct endpoint * ep) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = ep;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) p_die("epoll_ctl");
+}
+
+static uint32_t session_hash_of(const struct mapping * m, const struct sockaddr_in * peer) {
+	return ((peer->sin_addr.s_addr ^ ((uint32_t) peer->sin_port << 16) ^ m->public_port ^ m->protocol) * 2654435761u) >> 20;
+}
+
+/* function that closes a TCP connection, an event of its other socket may
+ * still be waiting in the batch, so it gets freed by free_closed_conns() */
+static void close_conn(struct conn * c) {
+	int i;
+	for (i = 0; i < 2; i++) {
+		close(c->fd[i]);
+		close(c->pipe[i][0]);
+		close(c->pipe[i][1]);
+	}
+	if (c->prev) c->prev->next = c->next;
+	else c->m->conns = c->next;
+	if (c->next) c->next->prev = c->prev;
+	c->closed = 1;
+	c->next = closed_conns;
+	closed_conns = c;
+}
+
+/* function that frees the connections closed since the last call */
+static void free_closed_conns() {
+	while (closed_conns) {
+		struct conn * c = closed_conns;
+		closed_conns = c->next;
+		free(c);
+	}
+}
+
+/* function that closes the socket of a UDP peer */
+static void close_session(struct session * s) {
+	close(s->fd);
+	struct session ** p = &session_hash[session_hash_of(s->m, &s->peer)];
+	while (*p != s) p = &(*p)->hash_next;
+	*p = s->hash_next;
+	if (s->prev) s->prev->next = s->next;
+	else s->m->sessions = s->next;
+	if (s->next) s->next->prev = s->prev;
+	free(s);
+}
+
+/* function that opens the public port of a mapping, return 0 on success and -1 on failure */
+static int open_mapping(const struct proxy_change * c) {
+	struct mapping * m = calloc(1, sizeof(*m));
+	if (m == NULL) p_die("calloc");
+	m->ep.kind = (c->protocol == TCP) ? EP_LISTENER : EP_UDP_PUBLIC;
+	m->protocol = c->protocol;
+	m->public_port = c->public_port;
+	m->destination.sin_family = AF_INET;
+	m->destination.sin_addr.s_addr = c->client;
+	m->destination.sin_port = c->private_port;
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr = listen_address;
+	addr.sin_port = c->public_port;
+
+	int one = 1;
+	m->fd = socket(AF_INET, ((c->protocol == TCP) ? SOCK_STREAM : SOCK_DGRAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (m->fd == -1) p_die("socket");
+	setsockopt(m->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(m->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+			(c->protocol == TCP && listen(m->fd, SOMAXCONN) == -1)) {
+		perror("proxy: bind");
+		close(m->fd);
+		free(m);
+		/* the port is not mapped after all */
+		__atomic_store_n(&rules[c->protocol - 1][ntohs(c->public_port)].used, 0, __ATOMIC_RELAXED);
+		return -1;
+	}
+	epoll_add(m->fd, EPOLLIN, &m->ep);
+	mappings[c->protocol - 1][ntohs(c->public_port)] = m;
+	return 0;
+}
+
+/* function that closes the public port of a mapping and everything forwarded through it */
+static void close_mapping(const char protocol, const uint16_t public_port) {
+	struct mapping * m = mappings[protocol - 1][ntohs(public_port)];
+	if (m == NULL) return;
+	while (m->conns) close_conn(m->conns);
+	while (m->sessions) close_session(m->sessions);
+	close(m->fd);
+	free(m);
+	mappings[protocol - 1][ntohs(public_port)] = NULL;
+}
+
+/* function that applies the changes passed by commit() */
+static void apply_inbox() {
+	uint64_t count;
+	if (read(wakeup_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) p_die("read");
+	pthread_mutex_lock(&inbox_lock);
+	size_t i;
+	for (i = 0; i < inbox_count; i++) {
+		close_mapping(inbox[i].protocol, inbox[i].public_port);
+		if (inbox[i].create && open_mapping(&inbox[i]) == -1) inbox[i].failed = 1;
+	}
+	inbox_count = 0;
+	pthread_cond_signal(&inbox_done);
+	pthread_mutex_unlock(&inbox_lock);
+}
+
+/* function that accepts new TCP connections and connects them to the client */
+static void accept_conns(struct mapping * m) {
+	while (1) {
+		int fd = accept4(m->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EAGAIN || errno == EINTR) return;
+			/* e.g. out of file descriptors, try again later */
+			perror("proxy: accept");
+			return;
+		}
+		struct conn * c = calloc(1, sizeof(*c));
+		if (c == NULL) p_die("calloc");
+		c->fd[0] = fd;
+		c->fd[1] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (c->fd[1] == -1 ||
+				(connect(c->fd[1], (struct sockaddr *) &m->destination, sizeof(m->destination)) == -1 && errno != EINPROGRESS) ||
+				pipe2(c->pipe[0], O_NONBLOCK | O_CLOEXEC) == -1 ||
+				pipe2(c->pipe[1], O_NONBLOCK | O_CLOEXEC) == -1) {
+			perror("proxy: connect");
+			close(fd);
+			if (c->fd[1] != -1) close(c->fd[1]);
+			if (c->pipe[0][0]) { close(c->pipe[0][0]); close(c->pipe[0][1]); }
+			free(c);
+			continue;
+		}
+		fcntl(c->pipe[0][1], F_SETPIPE_SZ, PIPE_SIZE);
+		fcntl(c->pipe[1][1], F_SETPIPE_SZ, PIPE_SIZE);
+		c->m = m;
+		c->next = m->conns;
+		if (c->next) c->next->prev = c;
+		m->conns = c;
+		int i;
+		for (i = 0; i < 2; i++) {
+			c->ep[i].kind = EP_TCP;
+			c->ep[i].side = i;
+			epoll_add(c->fd[i], EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &c->ep[i]);
+		}
+	}
+}
+
+/* function that moves data of one direction of a connection until nothing
+ * moves anymore, returns -1 if the connection failed */
+static int pump(struct conn * c, const int dir) {
+	int src = c->fd[dir], dst = c->fd[!dir];
+	if (c->eof[dir] && c->pending[dir] == 0) return 0;
+	while (1) {
+		int progress = 0;
+		if (!c->eof[dir] && c->pending[dir] < PIPE_SIZE) {
+			ssize_t n = splice(src, NULL, c->pipe[dir][1], NULL, PIPE_SIZE - c->pending[dir], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n > 0) {
+				c->pending[dir] += n;
+				progress = 1;
+			}
+			else if (n == 0) c->eof[dir] = 1;
+			else if (errno != EAGAIN) return -1;
+		}
+		if (c->pending[dir]) {
+			ssize_t n = splice(c->pipe[dir][0], NULL, dst, NULL, c->pending[dir], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n > 0) {
+				c->pending[dir] -= n;
+				progress = 1;
+			}
+			else if (n == -1 && errno != EAGAIN) return -1;
+		}
+		if (!progress) break;
+	}
+	/* pass the end of the stream on */
+	if (c->eof[dir] && c->pending[dir] == 0) shutdown(dst, SHUT_WR);
+	return 0;
+}
+
+/* function that handles an event on a socket of a TCP connection */
+static void handle_conn(struct conn * c, const uint32_t events) {
+	if (c->closed) return;
+	if (events & EPOLLERR || pump(c, 0) == -1 || pump(c, 1) == -1 ||
+			(c->eof[0] && c->eof[1] && c->pending[0] == 0 && c->pending[1] == 0))
+		close_conn(c);
+}
+
+/* function that returns the socket to the client of an outside UDP peer, opens it if needed */
+static struct session * get_session(struct mapping * m, const struct sockaddr_in * peer) {
+	uint32_t h = session_hash_of(m, peer);
+	struct session * s;
+	for (s = session_hash[h]; s; s = s->hash_next) {
+		if (s->m == m && s->peer.sin_addr.s_addr == peer->sin_addr.s_addr && s->peer.sin_port == peer->sin_port) return s;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL) p_die("calloc");
+	s->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (s->fd == -1 || connect(s->fd, (struct sockaddr *) &m->destination, sizeof(m->destination)) == -1) {
+		perror("proxy: connect");
+		if (s->fd != -1) close(s->fd);
+		free(s);
+		return NULL;
+	}
+	s->ep.kind = EP_UDP_SESSION;
+	s->peer = *peer;
+	s->m = m;
+	s->next = m->sessions;
+	if (s->next) s->next->prev = s;
+	m->sessions = s;
+	s->hash_next = session_hash[h];
+	session_hash[h] = s;
+	epoll_add(s->fd, EPOLLIN, &s->ep);
+	return s;
+}
+
+/* function that receives a batch of datagrams, returns their number */
+static int udp_receive(const int fd) {
+	int i;
+	for (i = 0; i < UDP_BATCH; i++) {
+		udp_iov[i].iov_base = udp_buf[i];
+		udp_iov[i].iov_len = UDP_BUFSIZE;
+		memset(&udp_msgs[i].msg_hdr, 0, sizeof(udp_msgs[i].msg_hdr));
+		udp_msgs[i].msg_hdr.msg_iov = &udp_iov[i];
+		udp_msgs[i].msg_hdr.msg_iovlen = 1;
+		udp_msgs[i].msg_hdr.msg_name = &udp_addr[i];
+		udp_msgs[i].msg_hdr.msg_namelen = sizeof(udp_addr[i]);
+	}
+	int n = recvmmsg(fd, udp_msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+	if (n == -1 && errno != EAGAIN && errno != EINTR && errno != ECONNREFUSED) perror("proxy: recvmmsg");
+	/* the received lengths become the lengths to send */
+	for (i = 0; i < n; i++) udp_iov[i].iov_len = udp_msgs[i].msg_len;
+	return n;
+}
+
+/* function that forwards datagrams from outside peers to the client */
+static void forward_udp_public(struct mapping * m) {
+	int n;
+	while ((n = udp_receive(m->fd)) > 0) {
+		/* send runs of datagrams of the same peer at once */
+		int i = 0;
+		while (i < n) {
+			struct session * s = get_session(m, &udp_addr[i]);
+			int j = i + 1;
+			while (j < n && udp_addr[j].sin_addr.s_addr == udp_addr[i].sin_addr.s_addr && udp_addr[j].sin_port == udp_addr[i].sin_port) j++;
+			if (s) {
+				int k;
+				for (k = i; k < j; k++) {
+					udp_msgs[k].msg_hdr.msg_name = NULL;
+					udp_msgs[k].msg_hdr.msg_namelen = 0;
+				}
+				s->last_active = now;
+				sendmmsg(s->fd, &udp_msgs[i], j - i, MSG_DONTWAIT);
+			}
+			i = j;
+		}
+		if (n < UDP_BATCH) break;
+	}
+}
+
+/* function that forwards answers of the client back to the outside peer */
+static void forward_udp_session(struct session * s) {
+	int n;
+	while ((n = udp_receive(s->fd)) > 0) {
+		int i;
+		for (i = 0; i < n; i++) {
+			udp_msgs[i].msg_hdr.msg_name = &s->peer;
+			udp_msgs[i].msg_hdr.msg_namelen = sizeof(s->peer);
+		}
+		s->last_active = now;
+		sendmmsg(s->m->fd, udp_msgs, n, MSG_DONTWAIT);
+		if (n < UDP_BATCH) break;
+	}
+}
+
+/* function that closes the sockets of UDP peers gone quiet */
+static void sweep_sessions() {
+	uint32_t h;
+	for (h = 0; h < SESSION_HASH_SIZE; h++) {
+		struct session * s = session_hash[h];
+		while (s) {
+			struct session * next = s->hash_next;
+			if (s->last_active + UDP_SESSION_TIMEOUT <= now) close_session(s);
+			s = next;
+		}
+	}
+}
+
+/* function that runs in the epoll thread */
+static void * serve(void * arg __attribute__ ((unused))) {
+	struct epoll_event events[EVENTS_MAXSIZE];
+	time_t next_sweep = time(NULL) + SWEEP_INTERVAL;
+	while (1) {
+		int n = epoll_wait(epoll_fd, events, EVENTS_MAXSIZE, SWEEP_INTERVAL * 1000);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			p_die("epoll_wait");
+		}
+		now = time(NULL);
+
+		/* mappings and sessions only get closed after the batch, the events point to them */
+		int wakeup = 0;
+		int i;
+		for (i = 0; i < n; i++) {
+			struct endpoint * ep = events[i].data.ptr;
+			switch (ep->kind) {
+				case EP_WAKEUP:
+					wakeup = 1;
+					break;
+				case EP_LISTENER:
+					accept_conns((struct mapping *) ep);
+					break;
+				case EP_TCP:
+					handle_conn((struct conn *) (ep - ep->side), events[i].events);
+					break;
+				case EP_UDP_PUBLIC:
+					forward_udp_public((struct mapping *) ep);
+					break;
+				case EP_UDP_SESSION:
+					forward_udp_session((struct session *) ep);
+					break;
+			}
+		}
+
+		if (wakeup) apply_inbox();
+		if (next_sweep <= now) {
+			sweep_sessions();
+			next_sweep = now + SWEEP_INTERVAL;
+		}
+		free_closed_conns();
+	}
+	return NULL;
+}
+
+static void dnat_init(int argc, char * argv[]) {
+	if (argc > 1) die("Give only the address to listen on as backend option.");
+	listen_address.s_addr = htonl(INADDR_ANY);
+	if (argc == 1 && inet_aton(argv[0], &listen_address) == 0) die("Backend option is not a valid ip address.");
+	debug_printf("Forwarding ports on address: %s\n", inet_ntoa(listen_address));
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) p_die("epoll_create1");
+	wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wakeup_fd == -1) p_die("eventfd");
+	epoll_add(wakeup_fd, EPOLLIN, &wakeup_ep);
+
+	/* signals are handled by the helper's thread only */
+	pthread_t thread;
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int err = pthread_create(&thread, NULL, serve, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		errno = err;
+		p_die("pthread_create");
+	}
+}
+
+/* search DNAT rule for given public port, return 1 if found, 0 if not found and -1 on error, set client and private_port if not NULL */
+static int get_dnat_rule_by_public_port(const char protocol, const uint16_t public_port, uint32_t * client, uint16_t * private_port) {
+	struct proxy_rule * r = &rules[protocol - 1][ntohs(public_port)];
+	if (!__atomic_load_n(&r->used, __ATOMIC_RELAXED)) return 0;
+	if (client) *client = r->client;
+	if (private_port) *private_port = r->private_port;
+	return 1;
+}
+
+/* search DNAT rule for given private port and client, return 1 if found, 0 if not found and -1 on error, set public_port if not NULL */
+static int get_dnat_rule_by_client_port(const char protocol __attribute__ ((unused)), uint16_t * public_port __attribute__ ((unused)), const uint32_t client __attribute__ ((unused)), const uint16_t private_port __attribute__ ((unused))) {
+	/* all mappings are leases of the daemon, so there are no manual ones to find */
+	return 0;
+}
+
+/* function that gets wrapped by create_dnat_rule() and destroy_dnat_rule() */
+static void change_dnat_rule(const uint32_t change, const char create, const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	if (queue_count == queue_size) {
+		queue_size = (queue_size) ? queue_size * 2 : 64;
+		queue = realloc(queue, queue_size * sizeof(*queue));
+		if (queue == NULL) p_die("realloc");
+	}
+	struct proxy_change * c = &queue[queue_count++];
+	c->change = change;
+	c->failed = 0;
+	c->create = create;
+	c->protocol = protocol;
+	c->public_port = public_port;
+	c->client = client;
+	c->private_port = private_port;
+}
+
+/* create a DNAT rule with given public port, client ip address and private port, return 0 on success and -1 on failure, the port gets opened on dnat_commit() */
+static int create_dnat_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	uint32_t change = changes++;
+	struct proxy_rule * r = &rules[protocol - 1][ntohs(public_port)];
+	if (r->used && r->client == client && r->private_port == private_port) return 0;
+	r->used = 1;
+	r->client = client;
+	r->private_port = private_port;
+	change_dnat_rule(change, 1, protocol, public_port, client, private_port);
+	return 0;
+}
+
+/* destroy a DNAT rule with given public port, client ip address and private port, return 0 on success, 1 when forbidden and -1 on failure, the port gets closed on dnat_commit() */
+static int destroy_dnat_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	uint32_t change = changes++;
+	struct proxy_rule * r = &rules[protocol - 1][ntohs(public_port)];
+	if (!r->used) return 0;
+	r->used = 0;
+	change_dnat_rule(change, 0, protocol, public_port, client, private_port);
+	return 0;
+}
+
+/* the queue of changes is the transaction */
+static int dnat_begin() {
+	changes = 0;
+	return 0;
+}
+
+/* pass all changes queued since the last commit to the epoll thread and wait until they are applied,
+ * return 0 on success and -1 if a port could not be opened */
+static int dnat_commit(void (*failed)(const uint32_t change)) {
+	if (queue_count == 0) return 0;
+	pthread_mutex_lock(&inbox_lock);
+	inbox = queue;
+	inbox_count = queue_count;
+	uint64_t one = 1;
+	if (write(wakeup_fd, &one, sizeof(one)) == -1) p_die("write");
+	while (inbox_count) pthread_cond_wait(&inbox_done, &inbox_lock);
+	pthread_mutex_unlock(&inbox_lock);
+
+	int ret = 0;
+	size_t i;
+	for (i = 0; i < queue_count; i++) {
+		if (!queue[i].failed) continue;
+		failed(queue[i].change);
+		ret = -1;
+	}
+	queue_count = 0;
+	return ret;
+}
+
+/* the mappings only live as long as this process, there is nothing to reload */
+static void dnat_reload() {
+}
+
+/* call found() for every mapping */
+static int list_dnat_rules(void (*found)(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port)) {
+	char protocol;
+	uint32_t port;
+	for (protocol = UDP; protocol <= TCP; protocol++) {
+		for (port = 0; port <= UINT16_MAX; port++) {
+			struct proxy_rule * r = &rules[protocol - 1][port];
+			if (r->used) found(protocol, htons(port), r->client, r->private_port);
+		}
+	}
+	return 0;
+}
+
+/* call taken() for the port of every mapping */
+static int list_dnat_ports(void (*taken)(const char protocol, const uint16_t port_low, const uint16_t port_high)) {
+	char protocol;
+	uint32_t port;
+	for (protocol = UDP; protocol <= TCP; protocol++) {
+		for (port = 0; port <= UINT16_MAX; port++) {
+			if (__atomic_load_n(&rules[protocol - 1][port].used, __ATOMIC_RELAXED)) taken(protocol, htons(port), htons(port));
+		}
+	}
+	return 0;
+}
+
+const struct dnat_backend linux_proxy_backend = {
+	.name = "proxy",
+	.init = dnat_init,
+	.get_rule_by_public_port = get_dnat_rule_by_public_port,
+	.get_rule_by_client_port = get_dnat_rule_by_client_port,
+	.begin = dnat_begin,
+	.create_rule = create_dnat_rule,
+	.destroy_rule = destroy_dnat_rule,
+	.commit = dnat_commit,
+	.reload = dnat_reload,
+	.list_rules = list_dnat_rules,
+	.list_ports = list_dnat_ports,
+};
@@ -19,29 +19,51 @@
 
 #define PROGRAM_VERSION "0.2.3"
 
+/* for recvmmsg() and sendmmsg() */
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 //#include <sys/types.h>
 #include <sys/ioctl.h>
-//#include <sys/socket.h>
+#include <sys/socket.h>
 //#include <netinet/in.h>
 #include <net/if.h>
-#include <poll.h>
+#include <linux/filter.h>
+#include <linux/rtnetlink.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <grp.h>
+#include <signal.h>
+#include <pthread.h>
+#include <pwd.h>
 
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/time.h>
 //#include <time.h>
 
 #include "die.h"
 #include "leases.h"
+#include "journal.h"
 #include "dnat_api.h"
+#include "dnat_helper.h"
+#include "dnat_queue.h"
+#include "sock_diag.h"
+#include "timer.h"
+#include "uring.h"
 #include "natpmp_defs.h"
 
 
-#define ADDRESS_CHECK_INTERVAL 1 /* s */
+#define BATCH_MAXSIZE 1024
+#define WORKERS_MAX 64
+#define ANSWER_CACHE_SIZE 1024 /* entries, must be a power of two */
+/* a client retransmits a request 250 ms after sending it, then doubling the
+ * interval every time, the cache covers the first three retransmissions, sent
+ * up to 1.75 s later */
+#define ANSWER_CACHE_RETRIES 3
+#define ANSWER_CACHE_WINDOW (NATPMP_RETRANSMIT_INTERVAL * ((1 << ANSWER_CACHE_RETRIES) - 1)) /* us */
 
 /* level of verbosity */
 int debuglevel;
@@ -62,21 +84,151 @@ uint16_t port_range_low;
 uint16_t port_range_high;
 /* an offset added to ports lower than the allowed range */
 uint16_t port_low_offset;
-
-/* cache for the public ip address */
+/* maximal number of leases, 0 to allow one lease per port in the range */
+uint32_t max_leases;
+/* maximal number of leases per client, 0 for no limit */
+uint32_t max_client_leases;
+/* the file to journal the leases to, NULL for no journal */
+char * journal_file;
+/* the journal files of every worker, opened before dropping privileges */
+int (*journal_fds)[2];
+/* lifetime of leases adopted from existing DNAT rules on startup, 0 to not adopt them */
+uint32_t grace_lifetime;
+/* number of requests received and answers sent with one system call */
+unsigned int batch_size;
+/* number of requests handled per socket before the next socket's turn */
+unsigned int socket_budget;
+/* wait for and send packets with io_uring instead of epoll */
+int use_uring;
+/* maximal age of the snapshot of bound ports in milliseconds, 0 to read it for every new lease */
+unsigned int bound_ports_age;
+/* number of worker threads, each with its own sockets and lease table */
+unsigned int workers;
+/* the user to run as after starting the helper, NULL to keep running as root */
+char * user;
+uid_t user_uid;
+gid_t user_gid;
+
+/* cache for the public ip address, only written by worker 0 */
 struct in_addr public_address;
 
 /* time this daemon has been started or tables got refreshed */
 uint32_t timestamp;
 
-/* actual time in seconds and microseconds, updated in the main loop */
-uint32_t now;
-uint64_t unow;
+/*
+ * Every worker thread serves its share of the clients, selected by a hash of
+ * their ip address, with sockets, a lease table and a DNAT queue of its own.
+ * The kernel steers the requests to the right worker's socket. Worker 0 runs
+ * in the main thread, and also checks the public address and handles signals.
+ * The state of a worker is thread local.
+ */
 
-/* list of socket file descriptors */
-struct pollfd * ufd_v;
-/* number of sockets */
+/* number of this worker */
+__thread unsigned int worker_id;
+/* the threads of workers 1 and up, and how many of them got started */
+pthread_t * worker_thread_v;
+unsigned int worker_thread_c;
+/* the thread of worker 0 */
+pthread_t main_thread;
+/* eventfd getting readable when the workers have to stop */
+int stop_fd = -1;
+
+/* DNAT rules found on startup, listed once by the main thread for all workers, by the worker serving their client */
+struct found_rules {
+	struct helper_record * v;
+	size_t c;
+} * found_rules;
+
+/* actual time in seconds and microseconds since boot, updated in the main loop */
+__thread uint32_t now;
+__thread uint64_t unow;
+
+/* socket file descriptors of all workers, the sockets of a worker follow each other */
+int * all_ufd_v;
+/* the sockets of this worker */
+__thread int * ufd_v;
+/* number of sockets per worker */
 int ufd_c;
+/* the other file descriptors watched, by their index */
+#define WATCH_QUEUE 0
+#define WATCH_TIMER 1
+#define WATCH_STOP 2
+#define WATCH_ADDRESS 3
+__thread int watch_v[4];
+__thread int watch_c;
+/* the epoll instance watching the sockets and the other file descriptors */
+__thread int epoll_fd = -1;
+/* events returned by epoll_wait() and the ones of each socket */
+__thread struct epoll_event * event_v;
+__thread uint32_t * ready_v;
+
+/* local ports bound by sockets, with the time they got read, 0 if never */
+__thread struct portmap bound_ports;
+__thread uint64_t bound_ports_time = 0;
+
+/* netlink socket telling about changes of ip addresses, only watched by worker 0 */
+int address_fd = -1;
+
+/* a map answer waiting for the DNAT rule changes of its request to get applied */
+struct pending_answer {
+	int ufd;
+	struct sockaddr_in t_addr;
+	natpmp_packet_map_answer packet;
+	uint16_t request_public_port;
+	uint32_t request_lifetime;
+	uint64_t first_op;
+	uint64_t last_op;
+};
+/* ring of pending answers, every one of them has at least one operation in the queue */
+__thread struct pending_answer pending_v[DNAT_QUEUE_SIZE];
+/* index of the oldest and number of pending answers */
+__thread uint32_t pending_first;
+__thread uint32_t pending_c;
+/* all DNAT rule changes below are done and checked */
+__thread uint64_t dnat_done;
+
+/* buffers for receiving a batch of requests */
+__thread natpmp_packet_request * request_v;
+__thread struct sockaddr_in * request_addr_v;
+__thread struct iovec * request_iov_v;
+__thread struct mmsghdr * request_msg_v;
+
+/* an answer waiting to be sent with the others of the batch */
+struct outgoing_answer {
+	int fd;
+	struct sockaddr_in t_addr;
+	natpmp_packet_answer packet;
+};
+/* the last successful answer to a map request of a client and private port,
+ * retransmissions of the request get it again without touching the leases */
+struct cached_answer {
+	/* time the answer was sent, 0 if the entry is unused */
+	uint64_t time;
+	/* the request answered */
+	uint32_t client;
+	uint8_t op;
+	uint16_t private_port;
+	uint16_t public_port;
+	uint32_t lifetime;
+	natpmp_packet_map_answer packet;
+};
+/* cache of answers, direct-mapped by client and private port */
+__thread struct cached_answer answer_cache[ANSWER_CACHE_SIZE];
+
+/* answers to send and their number */
+__thread struct outgoing_answer * answer_v;
+__thread struct iovec * answer_iov_v;
+__thread struct mmsghdr * answer_msg_v;
+__thread unsigned int answer_c;
+
+/* timers of a worker, the announcements run on worker 0 only */
+__thread struct timer announce_timer;
+__thread struct timer lease_timer;
+/* number of announcements sent since the public ip address changed */
+int announce_count;
+
+/* set by the SIGHUP handler */
+volatile sig_atomic_t reload_requested = 0;
 
 /* multicast address for sending address changes to */
 struct sockaddr_in multicast_address;
@@ -87,20 +239,84 @@ static const char * proto(const char protocol) {
 	die("proto: invalid protocol");
 }
 
+/* function that tells the other workers to stop and waits until they have released their state */
+void stop_workers() {
+	uint64_t one = 1;
+	if (stop_fd != -1 && write(stop_fd, &one, sizeof(one)) == -1) p_die("write");
+	unsigned int i;
+	for (i = 0; i < worker_thread_c; i++) pthread_join(worker_thread_v[i], NULL);
+	worker_thread_c = 0;
+}
+
+/* function that releases the state of the calling worker */
+void worker_close() {
+	dnat_queue_close();
+	if (epoll_fd != -1) close(epoll_fd);
+	epoll_fd = -1;
+	uring_close();
+	timer_close();
+	sock_diag_close();
+	free(event_v);
+	free(ready_v);
+	free(request_v);
+	free(request_addr_v);
+	free(request_iov_v);
+	free(request_msg_v);
+	free(answer_v);
+	free(answer_iov_v);
+	free(answer_msg_v);
+	journal_close();
+	leases_free();
+}
+
 /* close all sockets and free allocated memory */
 void close_all() {
 	int i;
-	for (i=0; i<ufd_c; i++) {
-		close(ufd_v[i].fd);
+	/* the other workers release their own state, only the main thread waits
+	 * for them, another one exiting on an error can't wait for the main thread */
+	if (pthread_equal(pthread_self(), main_thread)) stop_workers();
+	worker_close();
+	helper_close();
+	for (i=0; i<ufd_c * (int) workers; i++) {
+		close(all_ufd_v[i]);
 	}
-	free(ufd_v);
-	/* TODO free all leases */
+	if (address_fd != -1) close(address_fd);
+	if (stop_fd != -1) close(stop_fd);
+	free(all_ufd_v);
+	free(journal_fds);
+	free(worker_thread_v);
+	free(found_rules);
 }
 
-/* function for sending */
+/* send all answers collected so far, consecutive ones of the same socket with a single system call */
+void flush_answers() {
+	unsigned int i = 0;
+	while (i < answer_c) {
+		unsigned int j = i + 1;
+		while (j < answer_c && answer_v[j].fd == answer_v[i].fd) j++;
+		while (i < j) {
+			int sent = sendmmsg(answer_v[i].fd, &answer_msg_v[i], j - i, MSG_DONTROUTE);
+			if (sent == -1) p_die("sendmmsg");
+			i += sent;
+		}
+	}
+	answer_c = 0;
+}
+
+/* function for sending, the data gets sent with the next flush_answers() */
 void udp_send_r(const int fd, const struct sockaddr_in * t_addr, const void * data, const size_t len) {
-	int err = sendto(fd, data, len, MSG_DONTROUTE, (struct sockaddr *) t_addr, sizeof(*t_addr));
-	if (err == -1) p_die("sendto");
+	if (use_uring) {
+		uring_send(fd, t_addr, data, len);
+		return;
+	}
+	if (len > sizeof(natpmp_packet_answer)) die("udp_send_r: packet too long");
+	if (answer_c == batch_size) flush_answers();
+	struct outgoing_answer * a = &answer_v[answer_c];
+	a->fd = fd;
+	a->t_addr = *t_addr;
+	memcpy(&a->packet, data, len);
+	answer_iov_v[answer_c].iov_len = len;
+	answer_c++;
 }
 
 /* return seconds since daemon started or tables got refreshed */
@@ -129,6 +345,47 @@ struct in_addr get_ip_address(const char * ifname) {
 	}
 }
 
+/* function that subscribes to the changes of ipv4 addresses */
+void address_monitor_init() {
+	address_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (address_fd == -1) p_die("socket");
+	struct sockaddr_nl nl_addr;
+	memset(&nl_addr, 0, sizeof(nl_addr));
+	nl_addr.nl_family = AF_NETLINK;
+	nl_addr.nl_groups = RTMGRP_IPV4_IFADDR;
+	if (bind(address_fd, (struct sockaddr *) &nl_addr, sizeof(nl_addr)) == -1) p_die("bind");
+}
+
+/* function that reads all address changes received, returns 1 if the public
+ * interface may have got another address and 0 if not */
+int address_changed() {
+	/* the interface may have been created since the last time */
+	unsigned int ifindex = if_nametoindex(public_ifname);
+	int changed = 0;
+	char buf[8192] __attribute__ ((aligned (NLMSG_ALIGNTO)));
+	while (1) {
+		int len = recv(address_fd, buf, sizeof(buf), 0);
+		if (len == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) break;
+			/* messages got lost, check the address anyway */
+			if (errno == ENOBUFS) {
+				changed = 1;
+				continue;
+			}
+			p_die("recv");
+		}
+		struct nlmsghdr * nh;
+		for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type != RTM_NEWADDR && nh->nlmsg_type != RTM_DELADDR) continue;
+			struct ifaddrmsg * ifa = NLMSG_DATA(nh);
+			/* a removed interface has no index anymore, its addresses go away before */
+			if (ifindex == 0 || ifa->ifa_index == ifindex) changed = 1;
+		}
+	}
+	return changed;
+}
+
 /* send a NAT-PMP packet */
 void send_natpmp_packet(const int ufd, const struct sockaddr_in * t_addr, natpmp_packet_answer * packet, size_t size) {
 	packet->dummy.header.version = NATPMP_VERSION;
@@ -137,30 +394,53 @@ void send_natpmp_packet(const int ufd, const struct sockaddr_in * t_addr, natpmp
 	udp_send_r(ufd, t_addr, packet, size);
 }
 
-/* check if something is listening on a given port, return 0 if port is free and -1 if not */
-int is_port_free(const uint16_t port) {
-	/* TODO: find a nicer alternative than trying to bind the ports (perhaps have a look at netstat) */
+/* function that reads the bound ports again if the snapshot is too old */
+void refresh_bound_ports() {
+	if (bound_ports_time && unow - bound_ports_time < (uint64_t) bound_ports_age * 1000) return;
+	sock_diag_bound_ports(&bound_ports);
+	bound_ports_time = unow;
+}
 
-	/* creating the listen address */
-	struct sockaddr_in s_addr;
-	memset(&s_addr, 0, sizeof(s_addr));
-	s_addr.sin_family = AF_INET;
-	s_addr.sin_port = port;
-	s_addr.sin_addr.s_addr = 0; /* all addresses */
+/* function that returns the cache entry of a client and private port */
+struct cached_answer * answer_cache_entry(const uint32_t client, const uint16_t private_port) {
+	uint32_t h = (client ^ ((uint32_t) private_port << 16 | private_port)) * 0x9e3779b1;
+	return &answer_cache[(h >> 16) & (ANSWER_CACHE_SIZE - 1)];
+}
 
-	int try_bind(int type) {
-		/* create socket */
-		int fd = socket(PF_INET, type, 0);
-		if (fd == -1) p_die("socket");
-		/* bind to it */
-		int err = bind(fd, (struct sockaddr *) &s_addr, sizeof(s_addr));
-		close(fd);
-		return err;
-	}
+/* function that remembers a successful answer to a map request, answers to
+ * removals are not kept, repeating them is harmless and a cached one could
+ * hide leases created after it */
+void answer_cache_store(const uint32_t client, const uint16_t request_public_port, const uint32_t request_lifetime, const natpmp_packet_map_answer * packet) {
+	if (packet->answer.result != NATPMP_SUCCESS || request_lifetime == 0) return;
+	struct cached_answer * c = answer_cache_entry(client, packet->mapping.private_port);
+	c->time = unow;
+	c->client = client;
+	c->op = packet->header.op & ~NATPMP_ANSFLAG;
+	c->private_port = packet->mapping.private_port;
+	c->public_port = request_public_port;
+	c->lifetime = request_lifetime;
+	c->packet = *packet;
+}
 
-	if (try_bind(SOCK_STREAM) == -1) return -1;
-	if (try_bind(SOCK_DGRAM) == -1) return -1;
-	return 0;
+/* function that forgets the answer of a client and private port, its lease changed */
+void answer_cache_forget(const uint32_t client, const uint16_t private_port) {
+	struct cached_answer * c = answer_cache_entry(client, private_port);
+	if (c->client == client && c->private_port == private_port) c->time = 0;
+}
+
+/* function that answers a retransmitted map request from the cache, returns 1 if it did and 0 if not */
+int answer_cache_send(const int ufd, const struct sockaddr_in * t_addr, const natpmp_packet_map_request * request_packet) {
+	uint32_t client = t_addr->sin_addr.s_addr;
+	struct cached_answer * c = answer_cache_entry(client, request_packet->mapping.private_port);
+	if (c->time == 0 || unow - c->time >= ANSWER_CACHE_WINDOW || c->client != client ||
+			c->op != request_packet->header.op || c->private_port != request_packet->mapping.private_port ||
+			c->public_port != request_packet->mapping.public_port || c->lifetime != request_packet->mapping.lifetime)
+		return 0;
+	debug_printf("Answering retransmitted request of client %s from cache\n", inet_ntoa(t_addr->sin_addr));
+	/* the epoch gets updated */
+	natpmp_packet_map_answer packet = c->packet;
+	send_natpmp_packet(ufd, t_addr, (natpmp_packet_answer *) &packet, sizeof(packet));
+	return 1;
 }
 
 /* create or remove mappings */
@@ -177,26 +457,34 @@ void handle_map_request(const int ufd, const struct sockaddr_in * t_addr, const
 	answer_packet->mapping.public_port = request_packet->mapping.public_port;
 	answer_packet->mapping.lifetime = request_packet->mapping.lifetime;
 
+	/* the DNAT rule changes of this request get queued starting here */
+	uint64_t first_op = dnat_queue_head();
+
 	if (answer_packet->mapping.lifetime) {
 		/* creating a mapping is requested */
 
+		/* the lease changes, earlier answers to the client about it are outdated */
+		answer_cache_forget(client, answer_packet->mapping.private_port);
+
 		if (ntohl(answer_packet->mapping.lifetime) > max_lifetime) {
 			/* lifetime too high, downgrade */
 			debug_printf("Requested lifetime was %u, downgraded to %u\n", ntohl(answer_packet->mapping.lifetime), max_lifetime);
 			answer_packet->mapping.lifetime = htonl(max_lifetime);
 		}
 
-		struct lease * a = get_lease_by_client_port(client,
+		lease_t a = get_lease_by_client_port(client,
 				answer_packet->mapping.private_port);
-		if (a) {
-			if (a->expires[(int) protocol] != UINT32_MAX) {
+		if (a != NO_LEASE && leases.pending[a] & 1 << protocol) {
+			/* the DNAT rule is still being created, the answer waiting for it answers this retransmission too */
+			debug_printf("Lease with public %s port %hu for client %s is still pending\n", proto(protocol), ntohs(leases.public_port[a]), inet_ntoa(t_addr->sin_addr));
+			return;
+		}
+		if (a != NO_LEASE) {
+			if (leases.expires[(int) protocol][a] != UINT32_MAX) {
 				/* lease exists, update expiration time of the requested protocol and answer with public port */
-				uint32_t new_expires = now + ntohl(answer_packet->mapping.lifetime);
-				if (new_expires == next_lease_expires);
-				else if (new_expires < next_lease_expires) next_lease_expires = new_expires;
-				else if (a->expires[(int) protocol] <= next_lease_expires) update_expires = 1;
-				a->expires[(int) protocol] = new_expires;
-				answer_packet->mapping.public_port = a->public_port;
+				set_lease_expires(a, protocol, now + ntohl(answer_packet->mapping.lifetime));
+				journal_write(a);
+				answer_packet->mapping.public_port = leases.public_port[a];
 				debug_printf("Lease with public %s port %hu for client %s updated\n", proto(protocol), ntohs(answer_packet->mapping.public_port), inet_ntoa(t_addr->sin_addr));
 			}
 			else {
@@ -204,37 +492,50 @@ void handle_map_request(const int ufd, const struct sockaddr_in * t_addr, const
 				/* check for manual mapping */
 				/* TODO: remove redundant code */
 				uint16_t public_port;
-				int b = get_dnat_rule_by_client_port(protocol, &public_port, client, answer_packet->mapping.private_port);
-				if (b == -1) die("get_dnat_rule_by_client_port returned with error");
+				int b = helper_get_rule_by_client_port(protocol, &public_port, client, answer_packet->mapping.private_port);
+				if (b == -1) die("get_rule_by_client_port returned with error");
 				else if (b == 1) {
 					/* manual mapping exists, answer with public port */
 					answer_packet->mapping.public_port = public_port;
 					debug_printf("Manual mapping for public %s port %hu for client %s exists\n", proto(protocol), ntohs(answer_packet->mapping.public_port), inet_ntoa(t_addr->sin_addr));
 				}
+				else if (dnat_queue_space() == 0) {
+					/* too many DNAT rule changes pending, answer with out of resources */
+					answer_packet->answer.result = NATPMP_OUTOFRESOURCES;
+					debug_printf("DNAT queue is full\n");
+				}
 				else {
 					/* add the lease to the other one */
-					answer_packet->mapping.public_port = a->public_port;
+					answer_packet->mapping.public_port = leases.public_port[a];
 					/* add the lease to the database */
-					a->expires[(int) protocol] = now + ntohl(answer_packet->mapping.lifetime);
-					if (a->expires[(int) protocol] < next_lease_expires) next_lease_expires = a->expires[(int) protocol];
-					/* create the mapping*/
-					{
-						int c = create_dnat_rule(
-								protocol,
-								answer_packet->mapping.public_port,
-								client,
-								answer_packet->mapping.private_port);
-						if (c == -1) die("create_dnat_rule returned with error");
-					}
+					set_lease_expires(a, protocol, now + ntohl(answer_packet->mapping.lifetime));
+					/* create the mapping, it gets journaled when done */
+					leases.pending[a] |= 1 << protocol;
+					dnat_queue_create(
+							protocol,
+							answer_packet->mapping.public_port,
+							client,
+							answer_packet->mapping.private_port);
 					debug_printf("Lease with public %s port %hu for client %s added\n", proto(protocol), ntohs(answer_packet->mapping.public_port), inet_ntoa(t_addr->sin_addr));
 				}
 			}
 		}
+		else if (max_client_leases && get_lease_count_by_client(client) >= max_client_leases) {
+			/* client has used up its leases, answer with out of resources */
+			answer_packet->mapping.lifetime = request_packet->mapping.lifetime;
+			answer_packet->answer.result = NATPMP_OUTOFRESOURCES;
+			debug_printf("Client %s has reached the maximal number of leases\n", inet_ntoa(t_addr->sin_addr));
+		}
+		else if (dnat_queue_space() == 0) {
+			/* too many DNAT rule changes pending, answer with out of resources */
+			answer_packet->answer.result = NATPMP_OUTOFRESOURCES;
+			debug_printf("DNAT queue is full\n");
+		}
 		else {
 			/* no lease exists, check for manual mapping */
 			uint16_t public_port;
-			int b = get_dnat_rule_by_client_port(protocol, &public_port, client, answer_packet->mapping.private_port);
-			if (b == -1) die("get_dnat_rule_by_client_port returned with error");
+			int b = helper_get_rule_by_client_port(protocol, &public_port, client, answer_packet->mapping.private_port);
+			if (b == -1) die("get_rule_by_client_port returned with error");
 			else if (b == 1) {
 				/* manual mapping exists, answer with public port */
 				answer_packet->mapping.public_port = public_port;
@@ -254,10 +555,12 @@ void handle_map_request(const int ufd, const struct sockaddr_in * t_addr, const
 					answer_packet->mapping.public_port = htons(ntohs(answer_packet->mapping.public_port) %
 							(port_range_high - port_range_low + 1) + port_range_low);
 
-				/* find a free port */
-				uint16_t try_count = 0;
+				/* find a free port, one not used by leases, DNAT rules or local sockets */
+				refresh_bound_ports();
+				const struct portmap * taken[] = { &leased_ports, &rule_ports, &bound_ports };
+				int port = ntohs(answer_packet->mapping.public_port);
 				while (1) {
-					if (try_count++ > port_range_high - port_range_low) {
+					if ((port = portmap_find_clear(taken, sizeof(taken) / sizeof(*taken), port, port_range_low, port_range_high)) == -1) {
 						/* all ports checked, no free port found, restore variables and answer with out of resources */
 						answer_packet->mapping.public_port = request_packet->mapping.public_port;
 						answer_packet->mapping.lifetime = request_packet->mapping.lifetime;
@@ -265,52 +568,51 @@ void handle_map_request(const int ufd, const struct sockaddr_in * t_addr, const
 						debug_printf("No free ports available\n");
 						break;
 					}
-					if (get_lease_by_port(answer_packet->mapping.public_port) == NULL &&
-							is_port_free(answer_packet->mapping.public_port) == 0 &&
-							get_dnat_rule_by_public_port(TCP, answer_packet->mapping.public_port, NULL, NULL) == 0 &&
-							get_dnat_rule_by_public_port(UDP, answer_packet->mapping.public_port, NULL, NULL) == 0) {
-						/* TODO: acquiring the companion port to a manual mapping can be allowed to the same client */
-						/* these parameters are valid for mapping */
-
-						/* add the lease to the database */
-						{
-							struct lease c;
-							c.expires[UDP] = UINT32_MAX; c.expires[TCP] = UINT32_MAX;
-							c.expires[(int) protocol] = now + ntohl(answer_packet->mapping.lifetime);
-							c.client = client;
-							c.private_port = answer_packet->mapping.private_port;
-							c.public_port = answer_packet->mapping.public_port;
-							if (c.expires[(int) protocol] < next_lease_expires) next_lease_expires = c.expires[(int) protocol];
-							add_lease(&c);
-						}
+					answer_packet->mapping.public_port = htons(port);
+					/* TODO: acquiring the companion port to a manual mapping can be allowed to the same client */
+					/* these parameters are valid for mapping */
 
-						/* create the mapping*/
-						{
-							int c = create_dnat_rule(
-									protocol,
-									answer_packet->mapping.public_port,
-									client,
-									answer_packet->mapping.private_port);
-							if (c == -1) die("create_dnat_rule returned with error");
+					/* add the lease to the database */
+					{
+						a = add_lease(client, answer_packet->mapping.private_port, answer_packet->mapping.public_port);
+						if (a == NO_LEASE && !leases_full()) {
+							/* another worker leased the port meanwhile, its bit is set now, go on searching */
+							continue;
 						}
-
-						debug_printf("Lease with public %s port %hu for client %s created\n", proto(protocol), ntohs(answer_packet->mapping.public_port), inet_ntoa(t_addr->sin_addr));
-						break;
+						if (a == NO_LEASE) {
+							/* lease table is full, restore variables and answer with out of resources */
+							answer_packet->mapping.public_port = request_packet->mapping.public_port;
+							answer_packet->mapping.lifetime = request_packet->mapping.lifetime;
+							answer_packet->answer.result = NATPMP_OUTOFRESOURCES;
+							debug_printf("No free leases available\n");
+							break;
+						}
+						set_lease_expires(a, protocol, now + ntohl(answer_packet->mapping.lifetime));
 					}
 
-					if (ntohs(answer_packet->mapping.public_port) >= port_range_high) {
-						answer_packet->mapping.public_port = htons(port_range_low);
-					}
-					else {
-						answer_packet->mapping.public_port = htons(ntohs(answer_packet->mapping.public_port) + 1);
-					}
+					/* create the mapping, it gets journaled when done */
+					leases.pending[a] |= 1 << protocol;
+					dnat_queue_create(
+							protocol,
+							answer_packet->mapping.public_port,
+							client,
+							answer_packet->mapping.private_port);
+
+					debug_printf("Lease with public %s port %hu for client %s created\n", proto(protocol), ntohs(answer_packet->mapping.public_port), inet_ntoa(t_addr->sin_addr));
+					break;
 				}
 			}
 		}
 	}
+	else if (dnat_queue_space() < ((answer_packet->mapping.public_port == 0 && answer_packet->mapping.private_port == 0) ?
+				get_lease_count_by_client(client) : 1)) {
+		/* too many DNAT rule changes pending, answer with out of resources */
+		answer_packet->answer.result = NATPMP_OUTOFRESOURCES;
+		debug_printf("DNAT queue is full\n");
+	}
 	else {
 		/* remove a mapping */
-		struct lease * a;
+		lease_t a = NO_LEASE;
 		int remove_all;
 
 		if (answer_packet->mapping.public_port == 0 && answer_packet->mapping.private_port == 0) {
@@ -325,37 +627,28 @@ void handle_map_request(const int ufd, const struct sockaddr_in * t_addr, const
 			debug_printf("Trying to remove lease with public %s port %hu for client %s\n", proto(protocol), ntohs(answer_packet->mapping.public_port), inet_ntoa(t_addr->sin_addr));
 		}
 
-		struct lease *prev = NULL;
-		while (remove_all == 0 || (a = get_next_lease_by_client(client, prev))) {
-			if (a) {
-				/* destroy mapping */
-				int b = destroy_dnat_rule(protocol, a->public_port, client, a->private_port);
-				if (b == -1) die("destroy_dnat_rule returned with error");
-				else if (b == 1) {
-					/* mapping may not be destroyed, it's a manual mapping, answer with refused */
-					answer_packet->answer.result = NATPMP_REFUSED;
-					debug_printf("Lease with public %s port %hu for client %s could not be removed\n", proto(protocol), ntohs(a->public_port), inet_ntoa(t_addr->sin_addr));
-				}
-				else
-				{
-					if (debuglevel >= 2) printf("Lease with public %s port %hu for client %s removed\n", proto(protocol), ntohs(a->public_port), inet_ntoa(t_addr->sin_addr));
-				}
-
-				/* update used protocols of lease */
-				if (a->expires[(int) protocol] <= next_lease_expires) update_expires = 1;
-				a->expires[(int) protocol] = UINT32_MAX;
-				if (a->expires[UDP] == UINT32_MAX && a->expires[TCP] == UINT32_MAX) {
+		lease_t prev = NO_LEASE;
+		while (remove_all == 0 || (a = get_next_lease_by_client(client, prev)) != NO_LEASE) {
+			if (a != NO_LEASE) {
+				/* destroy mapping, a manual mapping gets refused when the queue is done */
+				dnat_queue_destroy(protocol, leases.public_port[a], client, leases.private_port[a]);
+				if (debuglevel >= 2) printf("Lease with public %s port %hu for client %s removed\n", proto(protocol), ntohs(leases.public_port[a]), inet_ntoa(t_addr->sin_addr));
+
+				/* update used protocols of lease, it gets journaled when the mapping is destroyed */
+				set_lease_expires(a, protocol, UINT32_MAX);
+				answer_cache_forget(client, leases.private_port[a]);
+				if (leases.expires[UDP][a] == UINT32_MAX && leases.expires[TCP][a] == UINT32_MAX) {
 					/* lease is no more used, remove it */
-					prev = a->prev;
+					prev = get_prev_lease_by_client(a);
 					remove_lease(a);
 				} else {
 					prev = a;
 				}
 			} else if (remove_all == 0) {
 				/* lease not found, check for manual mapping */
-				int b = get_dnat_rule_by_client_port(protocol, NULL, client, answer_packet->mapping.private_port);
+				int b = helper_get_rule_by_client_port(protocol, NULL, client, answer_packet->mapping.private_port);
 				if (b == -1) {
-					die("get_dnat_rule_by_client_port returned with error");
+					die("get_rule_by_client_port returned with error");
 				} else if (b == 1) {
 					/* manual mapping found, answer with refused */
 					answer_packet->answer.result = NATPMP_REFUSED;
@@ -363,7 +656,7 @@ void handle_map_request(const int ufd, const struct sockaddr_in * t_addr, const
 				}
 			}
 
-			if (remove_all == 0 || a == NULL) break;
+			if (remove_all == 0 || a == NO_LEASE) break;
 		}
 
 		if (answer_packet->answer.result == NATPMP_SUCCESS) {
@@ -372,8 +665,22 @@ void handle_map_request(const int ufd, const struct sockaddr_in * t_addr, const
 		}
 	}
 
-	/* fire the packet to the client */
-	send_natpmp_packet(ufd, t_addr, (natpmp_packet_answer *) answer_packet, sizeof(*answer_packet));
+	if (dnat_queue_head() != first_op) {
+		/* answer when the DNAT rules are applied */
+		struct pending_answer * p = &pending_v[(pending_first + pending_c++) % DNAT_QUEUE_SIZE];
+		p->ufd = ufd;
+		p->t_addr = *t_addr;
+		p->packet = *answer_packet;
+		p->request_public_port = request_packet->mapping.public_port;
+		p->request_lifetime = request_packet->mapping.lifetime;
+		p->first_op = first_op;
+		p->last_op = dnat_queue_head() - 1;
+	}
+	else {
+		/* fire the packet to the client */
+		send_natpmp_packet(ufd, t_addr, (natpmp_packet_answer *) answer_packet, sizeof(*answer_packet));
+		answer_cache_store(client, request_packet->mapping.public_port, request_packet->mapping.lifetime, answer_packet);
+	}
 
 #ifdef DEBUG_LEASES
 	printf("epoch: %u\n", now - timestamp);
@@ -381,6 +688,85 @@ void handle_map_request(const int ufd, const struct sockaddr_in * t_addr, const
 #endif
 }
 
+/* function that returns the lease a DNAT rule creation is for, NO_LEASE if the
+ * lease has gone meanwhile or its rule got requested again later */
+lease_t created_lease(const uint64_t seq) {
+	const struct helper_record * op = dnat_queue_op(seq);
+	lease_t a = get_lease_by_client_port(op->client, op->private_port);
+	if (a == NO_LEASE || leases.public_port[a] != op->public_port || leases.expires[(int) op->protocol][a] == UINT32_MAX) return NO_LEASE;
+	uint64_t s;
+	for (s = seq + 1; s < dnat_queue_head(); s++) {
+		const struct helper_record * later = dnat_queue_op(s);
+		if (later->type == HELPER_CREATE && later->protocol == op->protocol && later->public_port == op->public_port &&
+				later->client == op->client && later->private_port == op->private_port) return NO_LEASE;
+	}
+	return a;
+}
+
+/* function that removes the lease of a DNAT rule the backend could not create */
+void drop_failed_lease(const uint64_t seq, const lease_t a) {
+	const struct helper_record * op = dnat_queue_op(seq);
+	struct in_addr client_addr = { op->client };
+	fprintf(stderr, "Could not create DNAT rule for public %s port %hu of client %s\n", proto(op->protocol), ntohs(op->public_port), inet_ntoa(client_addr));
+	if (a == NO_LEASE) return;
+
+	set_lease_expires(a, op->protocol, UINT32_MAX);
+	journal_write(a);
+	answer_cache_forget(op->client, op->private_port);
+	if (leases.expires[UDP][a] == UINT32_MAX && leases.expires[TCP][a] == UINT32_MAX) remove_lease(a);
+}
+
+/* check the results of applied DNAT rule changes and send the answers waiting for them */
+void handle_dnat_completions() {
+	uint64_t done = dnat_queue_done();
+	uint64_t s;
+
+	for (s = dnat_done; s < done; s++) {
+		const struct helper_record * op = dnat_queue_op(s);
+		lease_t a = NO_LEASE;
+		if (op->type == HELPER_CREATE && (a = created_lease(s)) != NO_LEASE) {
+			/* the last queued creation of the rule is done, answer retransmissions again */
+			leases.pending[a] &= ~(1 << op->protocol);
+		}
+		if (dnat_queue_result(s) != -1) {
+			/* journal the lease of the committed rule as it is now, it may have gone meanwhile */
+			lease_t b = get_lease_by_client_port(op->client, op->private_port);
+			if (b != NO_LEASE && leases.public_port[b] == op->public_port) journal_write(b);
+			else journal_write_removal(op->client, op->private_port, op->public_port);
+			continue;
+		}
+		if (op->type != HELPER_CREATE) die("DNAT backend returned with error");
+		drop_failed_lease(s, a);
+	}
+	dnat_done = done;
+
+	while (pending_c && pending_v[pending_first].last_op < done) {
+		struct pending_answer * p = &pending_v[pending_first];
+		for (s = p->first_op; s <= p->last_op; s++) {
+			if (dnat_queue_result(s) == 1) {
+				/* mapping may not be destroyed, it's a manual mapping, answer with refused */
+				p->packet.answer.result = NATPMP_REFUSED;
+				p->packet.mapping.public_port = p->request_public_port;
+				debug_printf("Mapping for client %s could not be removed\n", inet_ntoa(p->t_addr.sin_addr));
+			}
+			else if (dnat_queue_result(s) == -1) {
+				/* the mapping could not be created, answer with out of resources */
+				p->packet.answer.result = NATPMP_OUTOFRESOURCES;
+				p->packet.mapping.public_port = p->request_public_port;
+				p->packet.mapping.lifetime = p->request_lifetime;
+			}
+		}
+		send_natpmp_packet(p->ufd, &p->t_addr, (natpmp_packet_answer *) &p->packet, sizeof(p->packet));
+		answer_cache_store(p->t_addr.sin_addr.s_addr, p->request_public_port, p->request_lifetime, &p->packet);
+		pending_first = (pending_first + 1) % DNAT_QUEUE_SIZE;
+		pending_c--;
+	}
+
+	/* results of pending answers are still needed */
+	if (pending_c && pending_v[pending_first].first_op < done) dnat_queue_release(pending_v[pending_first].first_op);
+	else dnat_queue_release(done);
+}
+
 /* being called on unsupported requests */
 void handle_unsupported_request(const int ufd, const struct sockaddr_in * t_addr, const natpmp_packet_dummy_request * request_packet, const uint16_t result) {
 	natpmp_packet_dummy_answer answer_packet;
@@ -393,17 +779,21 @@ void handle_unsupported_request(const int ufd, const struct sockaddr_in * t_addr
 void send_publicipaddress(const int ufd, const struct sockaddr_in * t_addr) {
 	natpmp_packet_publicipaddress_answer packet;
 	packet.header.op = NATPMP_PUBLICIPADDRESS;
-	if (public_address.s_addr) packet.answer.result = NATPMP_SUCCESS;
+	packet.public_ip_address = __atomic_load_n(&public_address.s_addr, __ATOMIC_RELAXED);
+	if (packet.public_ip_address) packet.answer.result = NATPMP_SUCCESS;
 	else packet.answer.result = NATPMP_NETFAILURE;
-	packet.public_ip_address = public_address.s_addr;
 	send_natpmp_packet(ufd, t_addr, (natpmp_packet_answer *) &packet, sizeof(packet));
 }
 
-/* initialize and bind udp */
-void udp_init(int * ufd, const uint32_t listen_address, const uint16_t listen_port) {
+/* initialize and bind udp, sockets of several workers share the address with reuseport set */
+void udp_init(int * ufd, const uint32_t listen_address, const uint16_t listen_port, const int reuseport) {
 	/* create UDP socket */
 	*ufd = socket(PF_INET, SOCK_DGRAM, 0);
 	if (*ufd == -1) p_die("socket");
+	if (reuseport) {
+		int one = 1;
+		if (setsockopt(*ufd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) p_die("setsockopt");
+	}
 
 	/* store local address and port to bind to */
 	struct sockaddr_in s_addr;
@@ -419,6 +809,32 @@ void udp_init(int * ufd, const uint32_t listen_address, const uint16_t listen_po
 	}
 }
 
+/* function that returns the worker serving a client, must match the filter of steer_clients() */
+unsigned int shard_of(const uint32_t client) {
+	return ((uint32_t) (ntohl(client) * 0x9e3779b1) >> 16) % workers;
+}
+
+/* function that returns the number of leases a worker can hold, its share of max_leases */
+uint32_t shard_capacity() {
+	return (max_leases + workers - 1) / workers;
+}
+
+/* let the kernel deliver the requests of a client to the socket of the worker
+ * serving it, ufd is the first socket of the group sharing an address, the
+ * filter returns the index of the socket in the order they were bound */
+void steer_clients(const int ufd) {
+	struct sock_filter code[] = {
+		/* source address of the ip header */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+		BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, workers),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+	if (setsockopt(ufd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) p_die("setsockopt");
+}
+
 /* function to fork to background and exit parent */
 void fork_to_background() {
 	pid_t child = fork();
@@ -447,64 +863,223 @@ void fork_to_background() {
 	}
 }
 
-void read_from_socket(const int s_i) {
-	/* construct packet, where the received data ist stored to */
-	natpmp_packet_request packet_request;
-	memset(&packet_request, 0, sizeof(packet_request));
-
-	/* construct struct, where information about the sender is stored to */
-	struct sockaddr_in t_addr;
-	memset(&t_addr, 0, sizeof(t_addr));
-
-	ssize_t pkgsize;
-	{
-		socklen_t t_len = sizeof(t_addr);
-		pkgsize = recvfrom(ufd_v[s_i].fd, &packet_request, sizeof(packet_request), MSG_DONTWAIT | MSG_TRUNC,
-				(struct sockaddr *) &t_addr, &t_len);
-		if (pkgsize == -1) p_die("recvfrom");
-		if (t_len != sizeof(t_addr)) die("pkgsize returned invalid from address len");
-	}
-	if (pkgsize == EAGAIN) return;
-
+/* handle a single received packet */
+void handle_request(const int ufd, const struct sockaddr_in * t_addr, natpmp_packet_request * packet_request, const ssize_t pkgsize) {
 	/* check for wrong or unsupported packets */
 	if (pkgsize < (ssize_t) sizeof(natpmp_packet_dummy_request)) return; /* TODO: errorlog */
-	if (packet_request.dummy.header.version != NATPMP_VERSION) {
+	if (packet_request->dummy.header.version != NATPMP_VERSION) {
 		/* Apple's Airport stations send an opcode of 0 here, but it's not defined in the draft,
 		 * perhaps this could be used for fingerprinting my implementation :-) */
 		debug_printf("Handling unsupported request...\n");
-		handle_unsupported_request(ufd_v[s_i].fd, &t_addr, &packet_request.dummy, NATPMP_UNSUPPORTEDVERSION);
+		handle_unsupported_request(ufd, t_addr, &packet_request->dummy, NATPMP_UNSUPPORTEDVERSION);
 		return;
 	}
-	if (packet_request.dummy.header.op & NATPMP_ANSFLAG) return;
+	if (packet_request->dummy.header.op & NATPMP_ANSFLAG) return;
 
 	/* do things depending on the packet's op code */
 	debug_printf("Handling request...\n");
-	switch (packet_request.dummy.header.op) {
+	switch (packet_request->dummy.header.op) {
 		case NATPMP_PUBLICIPADDRESS :
 			debug_printf("Handling public address...\n");
 			if (pkgsize < (ssize_t) sizeof(natpmp_packet_publicipaddress_request)) return; /* TODO: errorlog */
-			send_publicipaddress(ufd_v[s_i].fd, &t_addr);
+			send_publicipaddress(ufd, t_addr);
 			break;
 		case NATPMP_MAP_UDP :
 		case NATPMP_MAP_TCP :
 			debug_printf("Handling port mapping...\n");
 			if (pkgsize < (ssize_t) sizeof(natpmp_packet_map_request)) return; /* TODO: errorlog */
-			handle_map_request(ufd_v[s_i].fd, &t_addr, &packet_request.map);
+			/* clients retransmit until they get an answer */
+			if (answer_cache_send(ufd, t_addr, &packet_request->map)) break;
+			handle_map_request(ufd, t_addr, &packet_request->map);
 			break;
 		default :
-			handle_unsupported_request(ufd_v[s_i].fd, &t_addr, &packet_request.dummy, NATPMP_UNSUPPORTEDOP);
+			handle_unsupported_request(ufd, t_addr, &packet_request->dummy, NATPMP_UNSUPPORTEDOP);
+	}
+}
+
+/* receive up to max requests from a socket with a single system call and handle them, return their number */
+unsigned int read_from_socket(const int s_i, const unsigned int max) {
+	unsigned int i;
+	for (i = 0; i < max; i++) {
+		/* short packets leave the rest of the request zeroed */
+		memset(&request_v[i], 0, sizeof(request_v[i]));
+		request_msg_v[i].msg_hdr.msg_namelen = sizeof(request_addr_v[i]);
+	}
+
+	int count = recvmmsg(ufd_v[s_i], request_msg_v, max, MSG_DONTWAIT | MSG_TRUNC, NULL);
+	if (count == -1) {
+		if (errno == EAGAIN || errno == EINTR) return 0;
+		p_die("recvmmsg");
+	}
+
+	int r;
+	for (r = 0; r < count; r++) {
+		if (request_msg_v[r].msg_hdr.msg_namelen != sizeof(request_addr_v[r])) die("recvmmsg returned invalid from address len");
+		/* with MSG_TRUNC msg_len is the real size of the packet */
+		handle_request(ufd_v[s_i], &request_addr_v[r], &request_v[r], request_msg_v[r].msg_len);
+	}
+	return count;
+}
+
+/* handle a request received by the io_uring engine, data holds the first len bytes of it */
+void handle_received(const int s_i, const struct sockaddr_in * t_addr, const void * data, const size_t len, const ssize_t pkgsize) {
+	natpmp_packet_request packet_request;
+	memset(&packet_request, 0, sizeof(packet_request));
+	memcpy(&packet_request, data, (len < sizeof(packet_request)) ? len : sizeof(packet_request));
+	handle_request(ufd_v[s_i], t_addr, &packet_request, pkgsize);
+}
+
+/* handle the requests of a socket until it is drained or has used up its budget */
+void drain_socket(const int s_i) {
+	unsigned int handled = 0;
+	while (handled < socket_budget) {
+		unsigned int max = (socket_budget - handled < batch_size) ? socket_budget - handled : batch_size;
+		unsigned int count = read_from_socket(s_i, max);
+		handled += count;
+		/* a short batch means the socket is empty */
+		if (count < max) break;
+	}
+}
+
+/* allocate the buffers for batches of requests and answers, and point the message headers at them */
+void batch_init() {
+	request_v = calloc(batch_size, sizeof(*request_v));
+	request_addr_v = calloc(batch_size, sizeof(*request_addr_v));
+	request_iov_v = calloc(batch_size, sizeof(*request_iov_v));
+	request_msg_v = calloc(batch_size, sizeof(*request_msg_v));
+	answer_v = calloc(batch_size, sizeof(*answer_v));
+	answer_iov_v = calloc(batch_size, sizeof(*answer_iov_v));
+	answer_msg_v = calloc(batch_size, sizeof(*answer_msg_v));
+	if (request_v == NULL || request_addr_v == NULL || request_iov_v == NULL || request_msg_v == NULL ||
+			answer_v == NULL || answer_iov_v == NULL || answer_msg_v == NULL) p_die("calloc");
+
+	unsigned int i;
+	for (i = 0; i < batch_size; i++) {
+		request_iov_v[i].iov_base = &request_v[i];
+		request_iov_v[i].iov_len = sizeof(request_v[i]);
+		request_msg_v[i].msg_hdr.msg_iov = &request_iov_v[i];
+		request_msg_v[i].msg_hdr.msg_iovlen = 1;
+		request_msg_v[i].msg_hdr.msg_name = &request_addr_v[i];
+
+		answer_iov_v[i].iov_base = &answer_v[i].packet;
+		answer_msg_v[i].msg_hdr.msg_iov = &answer_iov_v[i];
+		answer_msg_v[i].msg_hdr.msg_iovlen = 1;
+		answer_msg_v[i].msg_hdr.msg_name = &answer_v[i].t_addr;
+		answer_msg_v[i].msg_hdr.msg_namelen = sizeof(answer_v[i].t_addr);
+	}
+}
+
+/* rules found on startup not fitting in the lease table, and number of adopted ones */
+__thread struct helper_record * stale_rules;
+__thread size_t stale_rules_c;
+__thread uint32_t adopted_rules_c;
+
+/* function that appends a DNAT rule to a list of rules */
+void append_rule(struct helper_record ** v, size_t * c, const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	if (*c % 64 == 0) {
+		*v = realloc(*v, (*c + 64) * sizeof(**v));
+		if (*v == NULL) p_die("realloc");
+	}
+	struct helper_record r = { HELPER_DESTROY, protocol, public_port, client, private_port, 0 };
+	(*v)[(*c)++] = r;
+}
+
+/* function that hands a DNAT rule found on startup to the worker serving its client */
+void find_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	struct found_rules * f = &found_rules[shard_of(client)];
+	append_rule(&f->v, &f->c, protocol, public_port, client, private_port);
+}
+
+/* function that lists the DNAT rules left by an earlier run for all workers */
+void find_rules() {
+	found_rules = calloc(workers, sizeof(*found_rules));
+	if (found_rules == NULL) p_die("calloc");
+	if (helper_list_rules(find_rule) == -1) die("list_rules returned with error");
+}
+
+/* function that turns a DNAT rule into a lease or remembers to destroy it */
+void adopt_rule(const char protocol, const uint16_t public_port, const uint32_t client, const uint16_t private_port) {
+	lease_t a = get_lease_by_port(public_port);
+	if (a == NO_LEASE && get_lease_by_client_port(client, private_port) == NO_LEASE &&
+			ntohs(public_port) >= port_range_low && ntohs(public_port) <= port_range_high)
+		a = add_lease(client, private_port, public_port);
+	/* the port is leased by another worker, leave it */
+	if (a == NO_LEASE && portmap_test(&leased_ports, ntohs(public_port))) return;
+	if (a != NO_LEASE && leases.client[a] == client && leases.private_port[a] == private_port) {
+		/* leases restored from the journal keep their expiration time */
+		if (leases.expires[(int) protocol][a] == UINT32_MAX) {
+			set_lease_expires(a, protocol, now + grace_lifetime);
+			journal_write(a);
+			adopted_rules_c++;
+		}
+		return;
+	}
+	/* the port is leased with this protocol to someone else, leave it */
+	if (a != NO_LEASE && leases.expires[(int) protocol][a] != UINT32_MAX) return;
+
+	append_rule(&stale_rules, &stale_rules_c, protocol, public_port, client, private_port);
+}
+
+/* function that turns the DNAT rules found for this worker into leases, so
+ * clients renewing them don't cause new rules, rules not fitting in are destroyed */
+void adopt_rules() {
+	struct found_rules * f = &found_rules[worker_id];
+	size_t i;
+	for (i = 0; i < f->c; i++) adopt_rule(f->v[i].protocol, f->v[i].public_port, f->v[i].client, f->v[i].private_port);
+	free(f->v);
+	f->v = NULL;
+
+	/* destroy the rest in batches */
+	for (i = 0; i < stale_rules_c; i += HELPER_BATCH_MAXSIZE) {
+		size_t count = (stale_rules_c - i < HELPER_BATCH_MAXSIZE) ? stale_rules_c - i : HELPER_BATCH_MAXSIZE;
+		helper_apply(&stale_rules[i], count);
+	}
+	free(stale_rules);
+
+	if (debuglevel >= 2) printf("Adopted %u existing DNAT rules, destroyed %zu\n", adopted_rules_c, stale_rules_c);
+}
+
+/* function that opens the journal files of all workers, worker 0 journals to
+ * the given file, the others to files with their number appended */
+void open_journals() {
+	journal_fds = malloc(workers * sizeof(*journal_fds));
+	if (journal_fds == NULL) p_die("malloc");
+	journal_prepare(journal_file, journal_fds[0]);
+	unsigned int w;
+	for (w = 1; w < workers; w++) {
+		char path[strlen(journal_file) + 12];
+		snprintf(path, sizeof(path), "%s.%u", journal_file, w);
+		journal_prepare(path, journal_fds[w]);
 	}
 }
 
+/* function being called on SIGHUP, the backend gets reloaded in the main loop */
+void handle_sighup(int sig __attribute__ ((unused))) {
+	reload_requested = 1;
+}
+
+/* function being called on SIGTERM and SIGINT, all workers leave their main loop */
+void handle_sigterm(int sig __attribute__ ((unused))) {
+	uint64_t one = 1;
+	if (write(stop_fd, &one, sizeof(one)) == -1) return;
+}
+
+/* function that switches to the user given on the command line, only the helper keeps running as root */
+void drop_privileges() {
+	if (initgroups(user, user_gid) == -1) p_die("initgroups");
+	if (setgid(user_gid) == -1) p_die("setgid");
+	if (setuid(user_uid) == -1) p_die("setuid");
+	if (debuglevel >= 2) printf("Running as user %s\n", user);
+}
+
+/* function that updates the current time, epochs and lifetimes don't jump with the wall clock */
 void update_time() {
-	struct timeval a;
-	gettimeofday(&a, NULL);
-	now = a.tv_sec;
-	unow = a.tv_usec + 1000000 * now;
+	unow = timer_now();
+	now = unow / 1000000;
 }
 
 void print_usage(const char * program_name) {
-	fprintf(stderr, "Usage: %s [-v | -q] [-b [-p pidfile]] -i public-interface -a private-address ... [-t max-lifetime] [-l lower-port] [-u upper-port] [[--] backend-options]\n", program_name);
+	fprintf(stderr, "Usage: %s [-v | -q] [-b [-p pidfile]] -i public-interface -a private-address ... [-t max-lifetime] [-l lower-port] [-u upper-port] [-m max-leases] [-c max-client-leases] [-j journal-file] [-g grace-lifetime] [-n batch-size] [-r socket-budget] [-s port-age] [-e engine] [-w workers] [-U user] [-B backend] [[--] backend-options]\n", program_name);
 }
 
 void print_help(const char * program_name) {
@@ -542,18 +1117,63 @@ void print_public_ip_address() {
 	}
 }
 
+/* function that sets up the buffers, the DNAT queue and the event loop of the calling worker */
+void worker_init() {
+	event_v = malloc((ufd_c + sizeof(watch_v) / sizeof(watch_v[0])) * sizeof(*event_v));
+	ready_v = calloc(ufd_c, sizeof(*ready_v));
+	if (event_v == NULL || ready_v == NULL) p_die("malloc");
+	batch_init();
+
+	/* start applying DNAT rule changes in the background */
+	dnat_queue_init();
+	timer_init();
+	sock_diag_init();
+
+	/* besides the sockets watch the DNAT queue, the timers and on worker 0 the addresses */
+	watch_v[WATCH_QUEUE] = dnat_queue_fd();
+	watch_v[WATCH_TIMER] = timer_fd();
+	watch_v[WATCH_STOP] = stop_fd;
+	watch_v[WATCH_ADDRESS] = address_fd;
+	watch_c = (worker_id == 0) ? 4 : 3;
+
+	if (use_uring) uring_init(ufd_v, ufd_c, watch_v, watch_c);
+	else {
+		/* the other file descriptors come after the sockets */
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd == -1) p_die("epoll_create1");
+		int i;
+		for (i = 0; i < ufd_c + watch_c; i++) {
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.u32 = i;
+			if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, (i < ufd_c) ? ufd_v[i] : watch_v[i - ufd_c], &ev) == -1) p_die("epoll_ctl");
+		}
+	}
+}
+
 void init(int argc, char * argv[]) {
 	/* set defaults */
 	max_lifetime = NATPMP_RECOMMENDED_LIFETIME;
 	port_range_low = 1024; /* ports below 1024 are restricted ports */
 	port_range_high = 65535; /* 65535 is the highest port available */
+	max_leases = 0;
+	max_client_leases = 0;
+	journal_file = NULL;
+	grace_lifetime = 0;
+	user = NULL;
+	batch_size = 32;
+	socket_budget = 64;
+	bound_ports_age = 1000;
+	use_uring = 0;
+	workers = 1;
 
 	if (argc==1) {
 		print_usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
-#define OPTSTRING "hVvqbp:i:a:t:l:u:"
+#define OPTSTRING "hVvqbp:i:a:t:l:u:m:c:j:g:n:r:s:e:w:U:B:"
 	/* parse the command line */
 	{
 		extern char *optarg;
@@ -577,9 +1197,7 @@ void init(int argc, char * argv[]) {
 			}
 		}
 
-		/* allocate memory for sockets */
-		ufd_v = malloc(ufd_c * sizeof(*ufd_v));
-		if (ufd_v == NULL) p_die("malloc");
+		/* allocate memory for addresses */
 		struct in_addr * laddresses = malloc(ufd_c * sizeof(*laddresses));
 		if (laddresses == NULL) p_die("malloc");
 
@@ -596,6 +1214,9 @@ void init(int argc, char * argv[]) {
 				case 'i':
 				case 'a':
 				case 't':
+				case 'j':
+				case 'U':
+				case 'B':
 					if (optarg[0] == '\0') {
 						fprintf(stderr, "%s: argument %i is a bit too short.\n", argv[0], optind - 1);
 						print_usage(argv[0]);
@@ -658,6 +1279,99 @@ void init(int argc, char * argv[]) {
 						exit(EXIT_FAILURE);
 					}
 					break;
+				case 'm': /* maximal number of leases */
+					max_leases = atol(optarg);
+					if (max_leases == 0) {
+						fprintf(stderr, "%s: argument %i is not a valid number of leases.\n", argv[0], optind - 1);
+						print_usage(argv[0]);
+						exit(EXIT_FAILURE);
+					}
+					break;
+				case 'c': /* maximal number of leases per client */
+					max_client_leases = atol(optarg);
+					if (max_client_leases == 0) {
+						fprintf(stderr, "%s: argument %i is not a valid number of leases.\n", argv[0], optind - 1);
+						print_usage(argv[0]);
+						exit(EXIT_FAILURE);
+					}
+					break;
+				case 'j': /* journal file */
+					journal_file = optarg;
+					break;
+				case 'g': /* adopt existing rules */
+					grace_lifetime = atol(optarg);
+					if (grace_lifetime == 0) {
+						fprintf(stderr, "%s: argument %i is not a valid lifetime.\n", argv[0], optind - 1);
+						print_usage(argv[0]);
+						exit(EXIT_FAILURE);
+					}
+					break;
+				case 'n': /* batch size */
+					batch_size = atol(optarg);
+					if (batch_size == 0 || batch_size > BATCH_MAXSIZE) {
+						fprintf(stderr, "%s: argument %i is not a valid batch size, use 1 to %u.\n", argv[0], optind - 1, BATCH_MAXSIZE);
+						print_usage(argv[0]);
+						exit(EXIT_FAILURE);
+					}
+					break;
+				case 'r': /* requests per socket and wakeup */
+					socket_budget = atol(optarg);
+					if (socket_budget == 0) {
+						fprintf(stderr, "%s: argument %i is not a valid number of requests.\n", argv[0], optind - 1);
+						print_usage(argv[0]);
+						exit(EXIT_FAILURE);
+					}
+					break;
+				case 's': /* maximal age of the bound ports */
+					{
+						char * end;
+						bound_ports_age = strtoul(optarg, &end, 10);
+						if (optarg[0] == '\0' || *end != '\0') {
+							fprintf(stderr, "%s: argument %i is not a valid age.\n", argv[0], optind - 1);
+							print_usage(argv[0]);
+							exit(EXIT_FAILURE);
+						}
+					}
+					break;
+				case 'e': /* I/O engine */
+					if (strcmp(optarg, "epoll") == 0) use_uring = 0;
+					else if (strcmp(optarg, "uring") == 0) use_uring = 1;
+					else {
+						fprintf(stderr, "%s: argument %i is not a valid engine, valid engines are: epoll uring\n", argv[0], optind - 1);
+						print_usage(argv[0]);
+						exit(EXIT_FAILURE);
+					}
+					break;
+				case 'w': /* worker threads */
+					workers = atol(optarg);
+					if (workers == 0 || workers > WORKERS_MAX) {
+						fprintf(stderr, "%s: argument %i is not a valid number of workers, use 1 to %u.\n", argv[0], optind - 1, WORKERS_MAX);
+						print_usage(argv[0]);
+						exit(EXIT_FAILURE);
+					}
+					break;
+				case 'B': /* backend */
+					dnat = find_dnat_backend(optarg);
+					if (dnat == NULL) {
+						fprintf(stderr, "%s: argument %i is not a valid backend, valid backends are: ", argv[0], optind - 1);
+						print_dnat_backends(stderr);
+						print_usage(argv[0]);
+						exit(EXIT_FAILURE);
+					}
+					break;
+				case 'U': /* user to run as */
+					user = optarg;
+					{
+						struct passwd * pw = getpwnam(user);
+						if (pw == NULL) {
+							fprintf(stderr, "%s: argument %i is not a valid user.\n", argv[0], optind - 1);
+							print_usage(argv[0]);
+							exit(EXIT_FAILURE);
+						}
+						user_uid = pw->pw_uid;
+						user_gid = pw->pw_gid;
+					}
+					break;
 				default: /* invalid option */
 					fprintf(stderr, "%s: argument %i is invalid.\n", argv[0], optind - 1);
 					print_usage(argv[0]);
@@ -695,19 +1409,28 @@ void init(int argc, char * argv[]) {
 		/* catch overflows */
 		if (port_low_offset < port_range_low) port_low_offset = port_range_low;
 
-		if (debuglevel >= 2) printf("Allowed port range: %hu..%hu, maximal lifetime: %u\n", port_range_low, port_range_high, max_lifetime);
+		/* every lease occupies a public port, so there are never more leases than ports in the range */
+		if (max_leases == 0 || max_leases > (uint32_t) (port_range_high - port_range_low + 1))
+			max_leases = port_range_high - port_range_low + 1;
+		leases_init(shard_capacity(), max_leases);
+
+		if (debuglevel >= 2) printf("Allowed port range: %hu..%hu, maximal lifetime: %u, maximal leases: %u\n", port_range_low, port_range_high, max_lifetime, max_leases);
 		if (max_lifetime < NATPMP_RECOMMENDED_LIFETIME)
 			fprintf(stderr, "Warning: using maximal lifetime lower than recommended value %u\n", NATPMP_RECOMMENDED_LIFETIME);
 
-		public_address = get_ip_address(public_ifname);
-		print_public_ip_address();
+		/* start the backend in the helper process, before opening any sockets */
+		if (debuglevel >= 2) printf("Using backend: %s\n", dnat->name);
+		helper_start(argc - optind, &argv[optind]);
 
-		/* initialize sockets */
+		/* initialize sockets, every worker gets one for each address */
+		all_ufd_v = malloc(workers * ufd_c * sizeof(*all_ufd_v));
+		if (all_ufd_v == NULL) p_die("malloc");
+		ufd_v = all_ufd_v;
 		for (i=0; i<ufd_c; i++) {
-			udp_init(&ufd_v[i].fd, laddresses[i].s_addr, NATPMP_PORT);
-
-			/* prepare data structures for poll */
-			ufd_v[i].events = POLLIN;
+			unsigned int w;
+			for (w = 0; w < workers; w++)
+				udp_init(&all_ufd_v[w * ufd_c + i], laddresses[i].s_addr, NATPMP_PORT, workers > 1);
+			if (workers > 1) steer_clients(ufd_v[i]);
 
 			if (laddresses[i].s_addr) {
 				if (debuglevel >= 2) printf("Listening on %s\n", inet_ntoa(laddresses[i]));
@@ -717,21 +1440,57 @@ void init(int argc, char * argv[]) {
 
 		free(laddresses);
 
-		dnat_init(argc - optind, &argv[optind]);
+		/* read the public ip address after subscribing to its changes, so none gets lost */
+		address_monitor_init();
+		public_address = get_ip_address(public_ifname);
+		print_public_ip_address();
+	}
+
+	/* set timestamp */
+	update_time();
+	timestamp = now;
+
+	/* restore leases and timestamp from the journal, the DNAT rules still exist */
+	if (journal_file) {
+		open_journals();
+		journal_open(journal_file, journal_fds[0], port_range_low, port_range_high, workers, 0, &timestamp);
+	}
+
+	/* adopt the rules the journal doesn't know about, the other workers adopt theirs when started */
+	if (grace_lifetime) {
+		find_rules();
+		adopt_rules();
 	}
 
 	/* fork into background, must be called before registering atexit functions */
 	if (do_fork) fork_to_background();
 
+	/* the PID file is written, run unprivileged from now on */
+	if (user) drop_privileges();
+
+	/* threads don't survive forking */
+	main_thread = pthread_self();
+	stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (stop_fd == -1) p_die("eventfd");
+	worker_init();
+
 	/* register functions being called on exit() */
 	{
 		int err = atexit(close_all);
 		if (err) die("atexit returned with error");
 	}
 
-	/* set timestamp */
-	update_time();
-	timestamp = now; /* TODO: move to where tables get (re)loaded */
+	/* reload the backend's rules on SIGHUP */
+	{
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = handle_sighup;
+		sa.sa_flags = SA_RESTART;
+		if (sigaction(SIGHUP, &sa, NULL) == -1) p_die("sigaction");
+		sa.sa_handler = handle_sigterm;
+		if (sigaction(SIGTERM, &sa, NULL) == -1) p_die("sigaction");
+		if (sigaction(SIGINT, &sa, NULL) == -1) p_die("sigaction");
+	}
 
 	/* fill out the multicast address for sending address changes to */
 	memset(&multicast_address, 0, sizeof(multicast_address));
@@ -740,114 +1499,205 @@ void init(int argc, char * argv[]) {
 	multicast_address.sin_addr.s_addr = NATPMP_MULTICAST_ADDRESS;
 }
 
-int main(int argc, char * argv[]) {
-	init(argc, argv);
+/* function that checks for a change of the public ip address, runs on worker 0 only */
+void check_address() {
+	struct in_addr address = get_ip_address(public_ifname);
+	if (address.s_addr != public_address.s_addr) {
+		__atomic_store_n(&public_address.s_addr, address.s_addr, __ATOMIC_RELAXED);
+		print_public_ip_address();
+		announce_count = 0;
+		timer_set(&announce_timer, unow);
+	}
+}
 
-	uint32_t next_address_check = now;
-	uint64_t next_announce_send = UINT64_MAX;
-	int announce_count = 0;
+/* function that announces the public ip address, repeated with doubling intervals after a change */
+void send_announcement(struct timer * t) {
+	if (public_address.s_addr) {
+		int i;
+		for (i=0; i<ufd_c; i++) {
+			send_publicipaddress(ufd_v[i], &multicast_address);
+		}
+	}
 
-	/* main loop */
-	while (42) {
-		/* wait until something's got received or we have to do somehing else */
-		int pollret;
-		{
-			int timeout1 = (next_address_check - now) * 1000;
-			if (next_announce_send != UINT64_MAX) {
-				int timeout2 = (next_announce_send - unow) / 1000;
-				if (timeout2 < timeout1) timeout1 = timeout2;
-			}
-			if (next_lease_expires != UINT32_MAX) {
-				int timeout3 = (next_lease_expires - now) * 1000;
-				if (timeout3 < timeout1) timeout1 = timeout3;
+	if (announce_count + 1 < NATPMP_ANNOUNCE_PACKETS && public_address.s_addr) {
+		timer_set(t, unow + (1 << announce_count) * NATPMP_ADDRESS_ANNOUNCE_INTERVAL);
+		announce_count++;
+	}
+	else {
+		announce_count = 0;
+	}
+}
+
+/* function that sets the lease timer to the lease expiring next, with a full
+ * DNAT queue expired leases wait for completions */
+void schedule_expiry() {
+	uint32_t next_lease_expires = get_next_lease_expires();
+	if (next_lease_expires != UINT32_MAX && dnat_queue_space() >= 2)
+		timer_set(&lease_timer, (uint64_t) next_lease_expires * 1000000);
+	else
+		timer_cancel(&lease_timer);
+}
+
+/* function that destroys expired mappings */
+void expire_leases(struct timer * t __attribute__ ((unused))) {
+	lease_t a;
+	while (dnat_queue_space() >= 2 && (a = get_next_expired_lease(now)) != NO_LEASE) {
+		/* local function that destroys the mapping */
+		void destroy_expired(const char protocol) {
+			if (leases.expires[(int) protocol][a] <= now) {
+				set_lease_expires(a, protocol, UINT32_MAX);
+				dnat_queue_destroy(protocol, leases.public_port[a], leases.client[a], leases.private_port[a]);
+				if (debuglevel >= 2) {
+					struct in_addr client = { leases.client[a] };
+					printf("Lease with public %s port %hu for client %s expired and removed\n", proto(protocol), ntohs(leases.public_port[a]), inet_ntoa(client));
+				}
 			}
+		}
 
-			pollret = poll(ufd_v, ufd_c, timeout1);
-			if (pollret == -1) p_die("poll");
+		destroy_expired(UDP);
+		destroy_expired(TCP);
+		answer_cache_forget(leases.client[a], leases.private_port[a]);
+
+		if (leases.expires[UDP][a] == UINT32_MAX && leases.expires[TCP][a] == UINT32_MAX) {
+			/* lease is no more used, remove it */
+			remove_lease(a);
 		}
+#ifdef DEBUG_LEASES
+		if (debuglevel >= 2) print_leases();
+#endif
+	}
+	schedule_expiry();
+}
+
+/* the main loop of a worker, only worker 0 checks the public address and handles signals */
+void worker_loop() {
+	/* the socket served first in this iteration */
+	int first_socket = 0;
+	/* bits of the other file descriptors having got readable while waiting */
+	int watch_ready = 0;
 
+	announce_timer.fire = send_announcement;
+	lease_timer.fire = expire_leases;
+
+	/* main loop */
+	while (42) {
 		/* update the current time */
 		update_time();
 
-		/* check for public ip address change */
-		if (next_address_check <= now) {
-			next_address_check = now + ADDRESS_CHECK_INTERVAL;
-			struct in_addr address = get_ip_address(public_ifname);
-			if (address.s_addr != public_address.s_addr) {
-				public_address = address;
-				print_public_ip_address();
-				next_announce_send = unow;
-				announce_count = 0;
-			}
+		/* read the rules of the backend again */
+		if (worker_id == 0 && reload_requested) {
+			reload_requested = 0;
+			helper_reload();
 		}
 
+		/* io_uring delivers the requests together with the readiness of the other file descriptors */
+		if (use_uring) watch_ready = uring_dispatch(handle_received);
+
+		/* the public ip address changed, announce it at once */
+		if ((watch_ready & (1 << WATCH_ADDRESS)) && address_changed()) check_address();
+
+		/* stop, the state of the worker gets released by its caller */
+		if (watch_ready & (1 << WATCH_STOP)) return;
+
+		/* answer requests whose DNAT rules got applied */
+		if (watch_ready & (1 << WATCH_QUEUE)) handle_dnat_completions();
+		watch_ready = 0;
+
 		/* check the sockets if something's got received */
 		{
+			/* every socket gets the same budget, and a different one goes first every time,
+			 * so a flooded interface can't starve the others, the rest waits for the next turn */
 			int i;
-			for (i=0; pollret>0; i++) {
-				if (ufd_v[i].revents) {
-					if (ufd_v[i].revents == POLLIN) read_from_socket(i);
-					/* TODO: handle the three error types differently */
+			for (i=0; i<ufd_c; i++) {
+				int s_i = (first_socket + i) % ufd_c;
+				if (ready_v[s_i]) {
+					if (ready_v[s_i] == EPOLLIN) drain_socket(s_i);
+					/* TODO: handle the error types differently */
 					else die("a socket file descriptor caused an error");
-					pollret--;
+					ready_v[s_i] = 0;
 				}
 			}
+			first_socket = (first_socket + 1) % ufd_c;
 		}
 
-		/* announce the public ip address on change */
-		if (next_announce_send <= unow) {
-			if (public_address.s_addr) {
-				int i;
-				for (i=0; i<ufd_c; i++) {
-					send_publicipaddress(ufd_v[i].fd, &multicast_address);
-				}
-			}
+		/* run the timers due, the requests may have changed the lease expiring next */
+		schedule_expiry();
+		timer_run(unow);
+
+		/* send the answers of this iteration */
+		flush_answers();
 
-			if (announce_count + 1 < NATPMP_ANNOUNCE_PACKETS && public_address.s_addr) {
-				next_announce_send = unow + (1 << announce_count) * NATPMP_ADDRESS_ANNOUNCE_INTERVAL;
-				announce_count++;
+		/* let the worker apply the DNAT rule changes of this iteration */
+		dnat_queue_flush();
+
+		/* wait until something's got received or a timer is due */
+		{
+			/* io_uring submits the answers of this iteration while waiting */
+			int count = 0;
+			if (use_uring) uring_wait();
+			else count = epoll_wait(epoll_fd, event_v, ufd_c + watch_c, -1);
+			if (count == -1) {
+				if (errno != EINTR) p_die("epoll_wait");
+				count = 0;
 			}
-			else {
-				next_announce_send = UINT64_MAX;
-				announce_count = 0;
+
+			/* the timerfd needs no handling, the due timers run in every iteration */
+			int i;
+			for (i = 0; i < count; i++) {
+				if (event_v[i].data.u32 < (uint32_t) ufd_c) ready_v[event_v[i].data.u32] = event_v[i].events;
+				else watch_ready |= 1 << (event_v[i].data.u32 - ufd_c);
 			}
 		}
+	}
+}
 
-		/* destroy expired mappings */
-		if (next_lease_expires <= now) {
-			update_expires = 1;
-			struct lease *a;
-			struct lease *prev = NULL;
-			while ((a = get_next_expired_lease(now, prev))) {
-				prev = a->prev;
-
-				/* local function that destroys the mapping */
-				void destroy_expired(const char protocol) {
-					if (a->expires[(int) protocol] <= now) {
-						a->expires[(int) protocol] = UINT32_MAX;
-						int b = destroy_dnat_rule(protocol, a->public_port, a->client, a->private_port);
-						if (b == -1) die("destroy_dnat_rule returned with error");
-						if (debuglevel >= 2) {
-							struct in_addr client = { a->client };
-							printf("Lease with public %s port %hu for client %s expired and removed\n", proto(protocol), ntohs(a->public_port), inet_ntoa(client));
-						}
-					}
-				}
+/* function that runs a worker thread, arg is the number of the worker */
+void * worker_thread(void * arg) {
+	worker_id = (uintptr_t) arg;
+	ufd_v = &all_ufd_v[worker_id * ufd_c];
+	leases_init(shard_capacity(), max_leases);
+	update_time();
 
-				destroy_expired(UDP);
-				destroy_expired(TCP);
+	/* the leases of every worker go to a journal file of its own, which only
+	 * gets restored if it is of the epoch restored by worker 0 */
+	if (journal_file) {
+		char path[strlen(journal_file) + 12];
+		snprintf(path, sizeof(path), "%s.%u", journal_file, worker_id);
+		uint32_t journal_timestamp = timestamp;
+		journal_open(path, journal_fds[worker_id], port_range_low, port_range_high, workers, 1, &journal_timestamp);
+	}
+	if (grace_lifetime) adopt_rules();
 
-				if (a->expires[UDP] == UINT32_MAX && a->expires[TCP] == UINT32_MAX) {
-					/* lease is no more used, remove it */
-					remove_lease(a);
-				}
-#ifdef DEBUG_LEASES
-				if (debuglevel >= 2) print_leases();
-#endif
-			}
-		}
+	worker_init();
+	worker_loop();
+	worker_close();
+	return NULL;
+}
 
-		/* update_expires if necessary */
-		do_update_expires();
+/* function that starts the workers besides worker 0, which is the main thread */
+void start_workers() {
+	/* signals are handled by the main thread only */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	worker_thread_v = malloc(workers * sizeof(*worker_thread_v));
+	if (worker_thread_v == NULL) p_die("malloc");
+	uintptr_t w;
+	for (w = 1; w < workers; w++) {
+		int err = pthread_create(&worker_thread_v[worker_thread_c], NULL, worker_thread, (void *) w);
+		if (err) {
+			errno = err;
+			p_die("pthread_create");
+		}
+		worker_thread_c++;
 	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+int main(int argc, char * argv[]) {
+	init(argc, argv);
+	start_workers();
+	worker_loop();
+	/* stopped by SIGTERM or SIGINT, the workers get stopped at exit */
+	exit(EXIT_SUCCESS);
 }
@@ -22,6 +22,7 @@
 #define NATPMP_MULTICAST_ADDRESS htonl(0xe0000001) /* 224.0.0.1 */
 #define NATPMP_ADDRESS_ANNOUNCE_INTERVAL 250000 /* us */
 #define NATPMP_ANNOUNCE_PACKETS 10
+#define NATPMP_RETRANSMIT_INTERVAL 250000 /* us, doubled after every retransmission */
 
 #define NATPMP_VERSION 0
 #define NATPMP_ANSFLAG 0x80
@@ -0,0 +1,97 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include <string.h>
+
+#include "portmap.h"
+
+/* function that clears all bits */
+void portmap_clear_all(struct portmap *m)
+{
+	memset(m, 0, sizeof(*m));
+}
+
+/* function that sets the bit of a port, returns 1 if it was clear and 0 if it
+ * was set already */
+int portmap_set(struct portmap *m, const uint16_t port)
+{
+	uint64_t bit = (uint64_t) 1 << (port % 64);
+	if (__atomic_fetch_or(&m->bits[port / 64], bit, __ATOMIC_ACQ_REL) & bit)
+		return 0;
+	__atomic_add_fetch(&m->count, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/* function that clears the bit of a port */
+void portmap_clear(struct portmap *m, const uint16_t port)
+{
+	uint64_t bit = (uint64_t) 1 << (port % 64);
+	if (__atomic_fetch_and(&m->bits[port / 64], ~bit, __ATOMIC_ACQ_REL) & bit)
+		__atomic_sub_fetch(&m->count, 1, __ATOMIC_RELAXED);
+}
+
+/* function that returns 1 if the bit of a port is set, 0 if not */
+int portmap_test(const struct portmap *m, const uint16_t port)
+{
+	return (__atomic_load_n(&m->bits[port / 64], __ATOMIC_ACQUIRE) >>
+			(port % 64)) & 1;
+}
+
+/* function that returns the first port from..to with a clear bit in all n
+ * bitmaps, -1 if there is none, scans a whole word at a time */
+static int find_clear(const struct portmap *const m[], const unsigned int n,
+		uint32_t from, const uint32_t to)
+{
+	while (from <= to) {
+		uint64_t w = 0;
+		unsigned int i;
+		for (i = 0; i < n; i++)
+			w |= __atomic_load_n(&m[i]->bits[from / 64],
+					__ATOMIC_RELAXED);
+		w = ~w & (UINT64_MAX << (from % 64));
+		if (w) {
+			uint32_t port = from / 64 * 64 + __builtin_ctzll(w);
+			return (port <= to) ? (int) port : -1;
+		}
+		from = (from / 64 + 1) * 64;
+	}
+	return -1;
+}
+
+/* function that returns the next port with a clear bit in all n bitmaps in
+ * the range low..high starting at start and wrapping around at high, -1 if
+ * every port in the range has a bit set in one of them */
+int portmap_find_clear(const struct portmap *const m[], const unsigned int n,
+		const uint16_t start, const uint16_t low, const uint16_t high)
+{
+	int port = find_clear(m, n, start, high);
+	if (port == -1 && start > low) port = find_clear(m, n, low, start - 1);
+	return port;
+}
+
+/* function that copies all bits of a bitmap, other threads see every word
+ * either before or after the copy */
+void portmap_copy(struct portmap *m, const struct portmap *from)
+{
+	uint32_t i;
+	for (i = 0; i < sizeof(m->bits) / sizeof(*m->bits); i++)
+		__atomic_store_n(&m->bits[i], from->bits[i], __ATOMIC_RELAXED);
+	__atomic_store_n(&m->count, from->count, __ATOMIC_RELAXED);
+}
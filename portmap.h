@@ -0,0 +1,44 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef PORTMAP_H
+#define PORTMAP_H
+
+#include <stdint.h>
+
+/*
+ * A bitmap with one bit for every port number, port numbers are in host byte
+ * order here. count holds the number of set bits. Setting and clearing bits is
+ * atomic, so several threads can share a bitmap without locking, exactly one
+ * of them succeeds in setting a bit.
+ */
+struct portmap {
+	uint64_t bits[(UINT16_MAX + 1) / 64];
+	uint32_t count;
+};
+
+void portmap_clear_all(struct portmap *m);
+int portmap_set(struct portmap *m, const uint16_t port);
+void portmap_clear(struct portmap *m, const uint16_t port);
+int portmap_test(const struct portmap *m, const uint16_t port);
+int portmap_find_clear(const struct portmap *const m[], const unsigned int n,
+		const uint16_t start, const uint16_t low, const uint16_t high);
+void portmap_copy(struct portmap *m, const struct portmap *from);
+
+#endif /* PORTMAP_H */
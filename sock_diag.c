@@ -0,0 +1,118 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/socket.h>
+#include <linux/inet_diag.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "die.h"
+#include "sock_diag.h"
+
+/* the netlink socket of the calling thread */
+static __thread int diag_fd = -1;
+
+/* function that opens the netlink socket of the calling thread */
+void sock_diag_init()
+{
+	diag_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+			NETLINK_SOCK_DIAG);
+	if (diag_fd == -1) p_die("socket");
+}
+
+/* function that closes the netlink socket of the calling thread */
+void sock_diag_close()
+{
+	if (diag_fd != -1) close(diag_fd);
+	diag_fd = -1;
+}
+
+/* function that sets the ports of all sockets of a family and protocol,
+ * returns -1 with errno set if the dump failed, 0 if not */
+static int dump(struct portmap *ports, const int family, const int protocol)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 req;
+	} request;
+	memset(&request, 0, sizeof(request));
+	request.nlh.nlmsg_len = sizeof(request);
+	request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	request.req.sdiag_family = family;
+	request.req.sdiag_protocol = protocol;
+	/* sockets in every state occupy their port */
+	request.req.idiag_states = ~0U;
+	if (send(diag_fd, &request, sizeof(request), 0) == -1) return -1;
+
+	char buf[16384] __attribute__ ((aligned (NLMSG_ALIGNTO)));
+	while (1) {
+		int len = recv(diag_fd, buf, sizeof(buf), 0);
+		if (len == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		struct nlmsghdr *nh;
+		for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, len);
+				nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type == NLMSG_DONE) return 0;
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(nh);
+				/* a kernel without IPv6 has no IPv6 sockets
+				 * either */
+				if (family == AF_INET6 &&
+						(err->error == -ENOENT ||
+						err->error == -EAFNOSUPPORT))
+					return 0;
+				errno = -err->error;
+				return -1;
+			}
+			struct inet_diag_msg *m = NLMSG_DATA(nh);
+			portmap_set(ports, ntohs(m->id.idiag_sport));
+		}
+	}
+}
+
+/* function that replaces the ports with the ones bound by TCP and UDP sockets,
+ * keeps them if the dump fails, as a failing dump like one running out of
+ * buffer space usually succeeds when tried again later */
+void sock_diag_bound_ports(struct portmap *ports)
+{
+	struct portmap bound;
+	portmap_clear_all(&bound);
+	if (dump(&bound, AF_INET, IPPROTO_TCP) == -1 ||
+			dump(&bound, AF_INET, IPPROTO_UDP) == -1 ||
+			dump(&bound, AF_INET6, IPPROTO_TCP) == -1 ||
+			dump(&bound, AF_INET6, IPPROTO_UDP) == -1) {
+		debug_printf("Reading bound ports failed: %s\n",
+				strerror(errno));
+		/* the rest of the failed dump would confuse the next one, if
+		 * no new socket can be opened the next dump tries again */
+		sock_diag_close();
+		diag_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+				NETLINK_SOCK_DIAG);
+		return;
+	}
+	memcpy(ports, &bound, sizeof(bound));
+}
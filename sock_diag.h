@@ -0,0 +1,37 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SOCK_DIAG_H
+#define SOCK_DIAG_H
+
+#include "portmap.h"
+
+/*
+ * Reads the local ports bound by TCP and UDP sockets of all processes with a
+ * dump of NETLINK_SOCK_DIAG, the same ss does, instead of probing every port
+ * by binding it. Ports of IPv6 sockets count too, they collide with IPv4 ones
+ * unless being IPv6 only. Every thread has a netlink socket of its own. A
+ * failed dump keeps the ports read before.
+ */
+
+void sock_diag_init();
+void sock_diag_close();
+void sock_diag_bound_ports(struct portmap *ports);
+
+#endif /* SOCK_DIAG_H */
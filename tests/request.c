@@ -0,0 +1,70 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Sends a request given in hex from a source address to a daemon on
+ * 127.0.0.1 and prints the answer in hex, what test.sh does with nc and od.
+ * Exits with failure if no answer arrives within a second.
+ */
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../natpmp_defs.h"
+
+int main(int argc, char ** argv) {
+	if (argc != 3 || strlen(argv[2]) % 2 || strlen(argv[2]) > 64) {
+		fprintf(stderr, "Usage: %s source-address hex-packet\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	unsigned char packet[32], answer[64];
+	size_t size = strlen(argv[2]) / 2, i;
+	for (i = 0; i < size; i++) {
+		unsigned int byte;
+		if (sscanf(argv[2] + 2 * i, "%2x", &byte) != 1) {
+			fprintf(stderr, "%s: %s is not a hex packet\n", argv[0], argv[2]);
+			return EXIT_FAILURE;
+		}
+		packet[i] = byte;
+	}
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	if (inet_aton(argv[1], &addr.sin_addr) == 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		fprintf(stderr, "%s: can't send from %s\n", argv[0], argv[1]);
+		return EXIT_FAILURE;
+	}
+	struct timeval tv = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	addr.sin_port = NATPMP_PORT;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sendto(fd, packet, size, 0, (struct sockaddr *) &addr, sizeof(addr));
+	int len = recv(fd, answer, sizeof(answer), 0);
+	if (len <= 0) return EXIT_FAILURE;
+	for (i = 0; i < (size_t) len; i++) printf("%02x", answer[i]);
+	printf("\n");
+	return EXIT_SUCCESS;
+}
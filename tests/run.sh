@@ -0,0 +1,194 @@
+#!/bin/bash
+#
+#    natpmp - an implementation of NAT-PMP
+#    Copyright (C) 2007-2008  Adrian Friedli
+#
+#   This program is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License along
+#   with this program; if not, write to the Free Software Foundation, Inc.,
+#   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+
+# Tests of a daemon on lo in a network namespace of its own: leases being
+# added, removed and expiring, running out of leases, the journal, the answer
+# cache and the nftables and proxy backends. Unlike test.sh it needs no second
+# machine, run it as root or it runs itself with unshare -Urn.
+
+[ $(id -u) -ne 0 ] && exec unshare -Urn "$0" "$@"
+
+cd "$(dirname "$0")/.." || exit 1
+make -s all tests/request || exit 1
+ip link set lo up
+
+DIR=$(mktemp -d)
+LOG=$DIR/log
+PID=
+ERROR=0
+
+function fatal_0 () {
+echo -e "F: $1"
+stop_daemon
+rm -rf "$DIR"
+exit 1
+}
+
+function error_1 () {
+echo -e "E:\t$1"
+ERROR=1
+}
+
+function warn_1 () {
+echo -e "W:\t$1"
+}
+
+function info_0 () {
+echo -e "I: $1"
+}
+
+function start_daemon () {
+backend=$1
+shift
+stdbuf -oL -eL ./natpmp -v -i lo -a 127.0.0.1 -B $backend "$@" > $LOG 2>&1 &
+PID=$!
+sleep 0.3
+kill -0 $PID 2>/dev/null
+}
+
+function stop_daemon () {
+[ -n "$PID" ] || return
+kill $PID 2>/dev/null
+wait $PID 2>/dev/null
+PID=
+}
+
+function request_mapping () {
+source_address=$1
+r_protocol=$2
+r_private_port=$3
+r_public_port=$4
+r_lifetime=$5
+
+answer=$(tests/request $source_address "$(printf "00%02x0000%04x%04x%08x" $r_protocol $r_private_port $r_public_port $r_lifetime)")
+[ -z "$answer" ] && fatal_0 "No answer received."
+
+resultcode=$((0x${answer:4:4}))
+epoch=$((0x${answer:8:8}))
+public_port=$((0x${answer:20:4}))
+lifetime=$((0x${answer:24:8}))
+return 0
+}
+
+# counts the lines of the log matching a pattern
+function logged () {
+grep -c "$1" $LOG
+}
+
+## leases ##
+start_daemon dummy || fatal_0 "The daemon didn't start."
+
+info_0 "Creating a mapping."
+request_mapping 127.0.0.2 1 2000 2000 3600
+[ $resultcode -ne 0 ] && error_1 "Mapping failed."
+old_public_port=$public_port
+
+info_0 "Trying to steal the mapping from another client."
+request_mapping 127.0.0.3 1 2000 $old_public_port 3600
+[ $public_port -eq $old_public_port ] && error_1 "The port was not reserved."
+
+info_0 "Getting the companion port."
+request_mapping 127.0.0.2 2 2000 2200 3600
+[ $public_port -ne $old_public_port ] && error_1 "Could not get the companion port."
+
+info_0 "Deleting the mapping."
+request_mapping 127.0.0.2 1 2000 0 0
+[ $resultcode -ne 0 -o $lifetime -ne 0 ] && error_1 "Incorrect answer."
+[ $(logged "destroy_dnat_rule(1, $old_public_port, 127.0.0.2, 2000)") -ne 1 ] && error_1 "The rule was not destroyed."
+
+info_0 "Letting a mapping expire."
+request_mapping 127.0.0.4 1 2100 2100 1
+expiring_public_port=$public_port
+sleep 2.5
+[ $(logged "destroy_dnat_rule(1, $expiring_public_port, 127.0.0.4, 2100)") -ne 1 ] && error_1 "The mapping did not expire."
+
+## answer cache ##
+info_0 "Repeating the removal of all mappings after creating one."
+request_mapping 127.0.0.5 1 0 0 0
+request_mapping 127.0.0.5 1 4200 4200 3600
+request_mapping 127.0.0.5 1 0 0 0
+[ $(logged "destroy_dnat_rule(1, [0-9]*, 127.0.0.5, 4200)") -ne 1 ] && error_1 "The removal was answered from the cache."
+
+info_0 "Repeating a mapping request."
+request_mapping 127.0.0.5 1 4300 4300 3600
+request_mapping 127.0.0.5 1 4300 4300 3600
+[ $(logged "create_dnat_rule(1, [0-9]*, 127.0.0.5, 4300)") -ne 1 ] && error_1 "The mapping was created twice."
+[ $(logged "from cache") -ne 1 ] && error_1 "The repeated request was not answered from the cache."
+stop_daemon
+
+## lease pool ##
+start_daemon dummy -m 2 || fatal_0 "The daemon didn't start with two leases."
+info_0 "Running out of leases."
+request_mapping 127.0.0.8 1 2000 2000 3600
+request_mapping 127.0.0.8 1 2001 2001 3600
+request_mapping 127.0.0.8 1 2002 2002 3600
+[ $resultcode -ne 4 ] && error_1 "A lease beyond the maximum was granted."
+request_mapping 127.0.0.8 1 2000 0 0
+request_mapping 127.0.0.8 1 2002 2002 3600
+[ $resultcode -ne 0 ] && error_1 "The lease given back was not reused."
+stop_daemon
+
+## journal ##
+start_daemon dummy -j $DIR/journal || fatal_0 "The daemon didn't start with a journal."
+info_0 "Creating a journaled mapping."
+request_mapping 127.0.0.6 1 3000 3000 3600
+journaled_public_port=$public_port
+stop_daemon
+
+start_daemon dummy -j $DIR/journal || fatal_0 "The daemon didn't start with a journal."
+info_0 "Renewing the mapping after a restart."
+[ $(logged "Restored leases") -ne 1 ] && error_1 "The journal was not restored."
+request_mapping 127.0.0.6 1 3000 4000 3600
+[ $public_port -ne $journaled_public_port ] && error_1 "The lease was not restored."
+[ $(logged "create_dnat_rule") -ne 0 ] && error_1 "The rule was created again."
+stop_daemon
+
+start_daemon dummy -j $DIR/journal -w 2 || fatal_0 "The daemon didn't start with two workers."
+info_0 "Restarting with another number of workers."
+[ $(logged "Restored leases") -ne 0 ] && error_1 "A journal of another number of workers was restored."
+stop_daemon
+
+## nftables backend ##
+if start_daemon nftables; then
+	info_0 "Creating and deleting a mapping with nftables."
+	request_mapping 127.0.0.7 1 2000 2000 3600
+	[ $resultcode -ne 0 ] && error_1 "Mapping failed."
+	request_mapping 127.0.0.7 1 2000 0 0
+	[ $resultcode -ne 0 ] && error_1 "Deleting failed."
+	kill -0 $PID 2>/dev/null || error_1 "The daemon died."
+	stop_daemon
+else
+	warn_1 "No nftables here, skipping its tests."
+	PID=
+fi
+
+## proxy backend ##
+start_daemon proxy || fatal_0 "The daemon didn't start with the proxy backend."
+info_0 "Forwarding a port with the proxy backend."
+request_mapping 127.0.0.1 2 5000 5000 3600
+[ $resultcode -ne 0 ] && error_1 "Mapping failed."
+(exec 3<>/dev/tcp/127.0.0.1/$public_port) 2>/dev/null || error_1 "The public port is not open."
+request_mapping 127.0.0.1 2 5000 0 0
+sleep 0.1
+(exec 3<>/dev/tcp/127.0.0.1/$public_port) 2>/dev/null && error_1 "The public port is still open."
+stop_daemon
+
+rm -rf "$DIR"
+exit $ERROR
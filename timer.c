@@ -0,0 +1,101 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <sys/timerfd.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "die.h"
+#include "timer.h"
+
+/* every thread has a timer queue of its own */
+
+/* the timerfd and the time it is armed for, 0 if disarmed */
+static __thread int tfd = -1;
+static __thread uint64_t armed;
+/* the pending timers, sorted by due time */
+static __thread struct timer * first = NULL;
+
+/* function that creates the timerfd of the calling thread */
+void timer_init() {
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd == -1) p_die("timerfd_create");
+	armed = 0;
+	first = NULL;
+}
+
+void timer_close() {
+	if (tfd != -1) close(tfd);
+	tfd = -1;
+}
+
+/* the file descriptor getting readable when a timer is due */
+int timer_fd() {
+	return tfd;
+}
+
+/* function that returns the current time in microseconds */
+uint64_t timer_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* function that sets a timer to be due at a given time, a pending one gets moved */
+void timer_set(struct timer * t, const uint64_t due) {
+	if (t->pending && t->due == due) return;
+	timer_cancel(t);
+	t->due = due;
+	t->pending = 1;
+	struct timer ** p = &first;
+	while (*p && (*p)->due <= due) p = &(*p)->next;
+	t->next = *p;
+	*p = t;
+}
+
+/* function that removes a timer from the queue, nothing happens if it isn't pending */
+void timer_cancel(struct timer * t) {
+	if (!t->pending) return;
+	struct timer ** p = &first;
+	while (*p != t) p = &(*p)->next;
+	*p = t->next;
+	t->pending = 0;
+}
+
+/* function that fires the timers due at now and arms the timerfd for the
+ * next one, must be called before waiting for the timerfd again */
+void timer_run(const uint64_t now) {
+	while (first && first->due <= now) {
+		struct timer * t = first;
+		first = t->next;
+		t->pending = 0;
+		t->fire(t);
+	}
+
+	/* setting the timerfd also clears an expiration not read yet */
+	uint64_t due = first ? first->due : 0;
+	if (due == armed) return;
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = due / 1000000;
+	its.it_value.tv_nsec = (due % 1000000) * 1000;
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) p_die("timerfd_settime");
+	armed = due;
+}
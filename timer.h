@@ -0,0 +1,53 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/*
+ * Timers of a thread, periodic ones just set themselves again when they fire.
+ * Pending timers are kept in a list sorted by their due time, a timerfd is
+ * armed for the first one and gets readable when it is due, so the event loop
+ * waits for it together with the sockets and never has to compute a timeout.
+ * Times are microseconds of CLOCK_MONOTONIC, which doesn't jump when the wall
+ * clock gets set. Every thread has a timer queue of its own.
+ */
+
+struct timer {
+	/* time the timer is due */
+	uint64_t due;
+	/* function being called when the timer is due */
+	void (*fire)(struct timer * t);
+	/* next pending timer, and whether this one is pending */
+	struct timer * next;
+	int pending;
+};
+
+void timer_init();
+void timer_close();
+int timer_fd();
+uint64_t timer_now();
+
+void timer_set(struct timer * t, const uint64_t due);
+void timer_cancel(struct timer * t);
+void timer_run(const uint64_t now);
+
+#endif /* TIMER_H */
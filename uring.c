@@ -0,0 +1,379 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "die.h"
+#include "uring.h"
+
+#ifndef NO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* number of submission queue entries, the completion queue is four times as big */
+#define SQ_ENTRIES 1024
+/* provided receive buffers, must be a power of two */
+#define BUF_COUNT 256
+#define BUF_SIZE 128
+#define BUF_GROUP 0
+/* number of answers in flight */
+#define SEND_SLOTS SQ_ENTRIES
+
+/* what a completion belongs to, in the upper half of its user_data */
+#define TAG_RECV 1
+#define TAG_SEND 2
+#define TAG_POLL 3
+#define USER_DATA(tag, index) (((uint64_t) (tag) << 32) | (index))
+
+/* every worker thread has a ring of its own */
+static __thread int ring_fd = -1;
+
+/* the rings shared with the kernel */
+static __thread void * sq_ring = MAP_FAILED;
+static __thread void * cq_ring = MAP_FAILED;
+static __thread size_t sq_ring_size, cq_ring_size;
+static __thread struct io_uring_sqe * sqes = MAP_FAILED;
+static __thread unsigned * sq_head, * sq_tail, * sq_mask, * sq_array;
+static __thread unsigned * cq_head, * cq_tail, * cq_mask;
+static __thread struct io_uring_cqe * cqes;
+static __thread unsigned sq_entries;
+/* entries filled in and entries handed to the kernel */
+static __thread unsigned sq_filled, sq_submitted;
+/* the last send of the current chain */
+static __thread struct io_uring_sqe * last_send = NULL;
+
+/* the provided buffers and the ring announcing them to the kernel */
+static __thread struct io_uring_buf_ring * buf_ring = MAP_FAILED;
+static __thread char * bufs = NULL;
+static __thread unsigned short buf_tail;
+
+/* the sockets and their receive requests */
+static __thread const int * sock_v;
+static __thread int sock_c;
+static __thread struct msghdr recv_msg;
+/* sockets whose multishot receive has ended */
+static __thread char * rearm_v;
+/* the other file descriptors watched, and a bit for each one having got readable */
+static __thread const int * watch_v;
+static __thread int watch_c;
+static __thread int watch_ready;
+
+/* an answer in flight */
+struct send_slot {
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_in t_addr;
+	char data[URING_SEND_MAXSIZE];
+};
+static __thread struct send_slot * slot_v;
+/* stack of free slots */
+static __thread unsigned * free_slot_v;
+static __thread unsigned free_slot_c;
+
+/* ring of receive completions waiting to be dispatched, each holds a buffer, so it never overflows */
+static __thread struct io_uring_cqe * received_v;
+static __thread unsigned received_head, received_tail;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params * p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(unsigned opcode, void * arg, unsigned nr_args) {
+	return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+/* function that hands the filled in entries to the kernel and waits for min_complete completions */
+static void enter(const unsigned min_complete) {
+	/* the chain of answers ends here */
+	if (last_send) {
+		last_send->flags &= ~IOSQE_IO_LINK;
+		last_send = NULL;
+	}
+	__atomic_store_n(sq_tail, sq_filled, __ATOMIC_RELEASE);
+
+	while (1) {
+		int ret = io_uring_enter(sq_filled - sq_submitted, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0);
+		if (ret == -1) {
+			if (errno == EINTR && sq_filled == sq_submitted) return;
+			if (errno == EINTR || errno == EAGAIN) continue;
+			p_die("io_uring_enter");
+		}
+		sq_submitted += ret;
+		if (sq_filled == sq_submitted) return;
+	}
+}
+
+/* function that returns a cleared submission queue entry, submits the queue if it is full */
+static struct io_uring_sqe * get_sqe() {
+	if (sq_filled - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) enter(0);
+	unsigned index = sq_filled & *sq_mask;
+	struct io_uring_sqe * sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[index] = index;
+	sq_filled++;
+	return sqe;
+}
+
+/* function that gives a receive buffer back to the kernel */
+static void recycle_buffer(const unsigned short bid) {
+	struct io_uring_buf * b = &buf_ring->bufs[buf_tail & (BUF_COUNT - 1)];
+	b->addr = (uint64_t) (uintptr_t) (bufs + bid * BUF_SIZE);
+	b->len = BUF_SIZE;
+	b->bid = bid;
+	buf_tail++;
+	__atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+/* function that starts the multishot receive of a socket */
+static void arm_recv(const int s_i) {
+	struct io_uring_sqe * sqe = get_sqe();
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = sock_v[s_i];
+	sqe->addr = (uint64_t) (uintptr_t) &recv_msg;
+	sqe->len = 1;
+	/* report the real size of truncated packets */
+	sqe->msg_flags = MSG_TRUNC;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUF_GROUP;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = USER_DATA(TAG_RECV, s_i);
+	rearm_v[s_i] = 0;
+}
+
+/* function that starts watching one of the other file descriptors */
+static void arm_poll(const int w_i) {
+	struct io_uring_sqe * sqe = get_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = watch_v[w_i];
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = USER_DATA(TAG_POLL, w_i);
+}
+
+/* function that takes all completions off the completion queue, answers and
+ * polls are done with, receptions are kept for uring_dispatch() */
+static void reap() {
+	unsigned head = *cq_head;
+	unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe * cqe = &cqes[head & *cq_mask];
+		unsigned index = cqe->user_data & 0xffffffff;
+		switch (cqe->user_data >> 32) {
+			case TAG_RECV:
+				if (cqe->flags & IORING_CQE_F_BUFFER) received_v[received_tail++ & (BUF_COUNT - 1)] = *cqe;
+				else if (cqe->res != -ENOBUFS && cqe->res != -EINTR && cqe->res != -EAGAIN) {
+					errno = -cqe->res;
+					p_die("io_uring recvmsg");
+				}
+				/* out of buffers, start again when some are back */
+				if (!(cqe->flags & IORING_CQE_F_MORE)) rearm_v[index] = 1;
+				break;
+			case TAG_SEND:
+				if (cqe->res < 0 && cqe->res != -ECANCELED) {
+					errno = -cqe->res;
+					p_die("io_uring sendmsg");
+				}
+				free_slot_v[free_slot_c++] = index;
+				break;
+			case TAG_POLL:
+				watch_ready |= 1 << index;
+				if (!(cqe->flags & IORING_CQE_F_MORE)) arm_poll(index);
+				break;
+		}
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+void uring_init(const int * fds, const int count, const int * watch_fds, const int watch_count) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = SQ_ENTRIES * 4;
+	ring_fd = io_uring_setup(SQ_ENTRIES, &p);
+	if (ring_fd == -1) p_die("io_uring_setup");
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) die("io_uring of this kernel is too old");
+
+	/* map the rings */
+	sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_ring_size > sq_ring_size) sq_ring_size = cq_ring_size;
+	sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED) p_die("mmap");
+	cq_ring = sq_ring;
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) p_die("mmap");
+	sq_head = sq_ring + p.sq_off.head;
+	sq_tail = sq_ring + p.sq_off.tail;
+	sq_mask = sq_ring + p.sq_off.ring_mask;
+	sq_array = sq_ring + p.sq_off.array;
+	cq_head = cq_ring + p.cq_off.head;
+	cq_tail = cq_ring + p.cq_off.tail;
+	cq_mask = cq_ring + p.cq_off.ring_mask;
+	cqes = cq_ring + p.cq_off.cqes;
+	sq_entries = p.sq_entries;
+	sq_filled = sq_submitted = *sq_tail;
+
+	/* register the provided buffers */
+	buf_ring = mmap(NULL, BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf_ring == MAP_FAILED) p_die("mmap");
+	bufs = malloc(BUF_COUNT * BUF_SIZE);
+	if (bufs == NULL) p_die("malloc");
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) buf_ring;
+	reg.ring_entries = BUF_COUNT;
+	reg.bgid = BUF_GROUP;
+	if (io_uring_register(IORING_REGISTER_PBUF_RING, &reg, 1) == -1) p_die("io_uring_register");
+	buf_tail = 0;
+	unsigned short i;
+	for (i = 0; i < BUF_COUNT; i++) recycle_buffer(i);
+
+	/* answers in flight */
+	slot_v = malloc(SEND_SLOTS * sizeof(*slot_v));
+	free_slot_v = malloc(SEND_SLOTS * sizeof(*free_slot_v));
+	received_v = malloc(BUF_COUNT * sizeof(*received_v));
+	rearm_v = calloc(count, sizeof(*rearm_v));
+	if (slot_v == NULL || free_slot_v == NULL || received_v == NULL || rearm_v == NULL) p_die("malloc");
+	for (free_slot_c = 0; free_slot_c < SEND_SLOTS; free_slot_c++) free_slot_v[free_slot_c] = SEND_SLOTS - 1 - free_slot_c;
+	received_head = received_tail = 0;
+
+	/* the buffers hold the recvmsg header, the address and the payload */
+	memset(&recv_msg, 0, sizeof(recv_msg));
+	recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+
+	sock_v = fds;
+	sock_c = count;
+	int s_i;
+	for (s_i = 0; s_i < sock_c; s_i++) arm_recv(s_i);
+	watch_v = watch_fds;
+	watch_c = watch_count;
+	watch_ready = 0;
+	int w_i;
+	for (w_i = 0; w_i < watch_c; w_i++) arm_poll(w_i);
+	enter(0);
+}
+
+void uring_close() {
+	if (ring_fd != -1) close(ring_fd);
+	if (sqes != MAP_FAILED) munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+	if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+	if (buf_ring != MAP_FAILED) munmap(buf_ring, BUF_COUNT * sizeof(struct io_uring_buf));
+	free(bufs);
+	free(slot_v);
+	free(free_slot_v);
+	free(received_v);
+	free(rearm_v);
+	ring_fd = -1;
+}
+
+/* submit everything queued and wait until something completes */
+void uring_wait() {
+	int s_i;
+	for (s_i = 0; s_i < sock_c; s_i++) {
+		if (rearm_v[s_i]) arm_recv(s_i);
+	}
+
+	enter(1);
+}
+
+/* call received() for every request received, return the bits of the watched file descriptors having got readable */
+int uring_dispatch(void (*received)(const int s_i, const struct sockaddr_in * t_addr, const void * data, const size_t len, const ssize_t size)) {
+	reap();
+
+	/* received() may reap more when sending */
+	while (received_head != received_tail) {
+		struct io_uring_cqe * cqe = &received_v[received_head++ & (BUF_COUNT - 1)];
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		struct io_uring_recvmsg_out * out = (struct io_uring_recvmsg_out *) (bufs + bid * BUF_SIZE);
+		if (out->namelen != sizeof(struct sockaddr_in)) die("io_uring recvmsg returned invalid from address len");
+		struct sockaddr_in t_addr;
+		memcpy(&t_addr, out + 1, sizeof(t_addr));
+		/* payloadlen is the real size of the packet, only the start of a big one is in the buffer */
+		size_t len = cqe->res - sizeof(*out) - recv_msg.msg_namelen;
+		received(cqe->user_data & 0xffffffff, &t_addr, (char *) (out + 1) + recv_msg.msg_namelen, len, out->payloadlen);
+		recycle_buffer(bid);
+	}
+
+	int ready = watch_ready;
+	watch_ready = 0;
+	return ready;
+}
+
+/* queue an answer, it gets submitted with the next uring_wait() */
+void uring_send(const int fd, const struct sockaddr_in * t_addr, const void * data, const size_t len) {
+	if (len > URING_SEND_MAXSIZE) die("uring_send: packet too long");
+	/* wait for answers in flight if all slots are taken */
+	while (free_slot_c == 0) {
+		enter(1);
+		reap();
+	}
+	unsigned index = free_slot_v[--free_slot_c];
+	struct send_slot * slot = &slot_v[index];
+	memcpy(slot->data, data, len);
+	slot->t_addr = *t_addr;
+	slot->iov.iov_base = slot->data;
+	slot->iov.iov_len = len;
+	memset(&slot->msg, 0, sizeof(slot->msg));
+	slot->msg.msg_name = &slot->t_addr;
+	slot->msg.msg_namelen = sizeof(slot->t_addr);
+	slot->msg.msg_iov = &slot->iov;
+	slot->msg.msg_iovlen = 1;
+
+	struct io_uring_sqe * sqe = get_sqe();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) &slot->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_DONTROUTE;
+	/* answers go out in order, a failing one cancels the rest */
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = USER_DATA(TAG_SEND, index);
+	last_send = sqe;
+}
+
+#else /* NO_URING */
+
+void uring_init(const int * fds __attribute__ ((unused)), const int count __attribute__ ((unused)), const int * watch_fds __attribute__ ((unused)), const int watch_count __attribute__ ((unused))) {
+	die("built without io_uring support");
+}
+
+void uring_close() {
+}
+
+void uring_wait() {
+}
+
+int uring_dispatch(void (*received)(const int s_i, const struct sockaddr_in * t_addr, const void * data, const size_t len, const ssize_t size) __attribute__ ((unused))) {
+	return 0;
+}
+
+void uring_send(const int fd __attribute__ ((unused)), const struct sockaddr_in * t_addr __attribute__ ((unused)), const void * data __attribute__ ((unused)), const size_t len __attribute__ ((unused))) {
+}
+
+#endif /* NO_URING */
@@ -0,0 +1,44 @@
+/*
+ *    natpmp - an implementation of NAT-PMP
+ *    Copyright (C) 2007-2008  Adrian Friedli
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+/*
+ * An alternative to the epoll loop built on io_uring. Every socket gets a
+ * multishot recvmsg drawing from a ring of provided buffers, the answers are
+ * submitted as linked sendmsg requests, and other file descriptors, like the
+ * DNAT queue and the timers, are watched with multishot polls. Everything
+ * queued during an iteration of the main loop gets submitted by the single
+ * io_uring_enter() of uring_wait().
+ */
+
+/* biggest packet uring_send() takes */
+#define URING_SEND_MAXSIZE 64
+
+void uring_init(const int * fds, const int count, const int * watch_fds, const int watch_count);
+void uring_close();
+void uring_wait();
+int uring_dispatch(void (*received)(const int s_i, const struct sockaddr_in * t_addr, const void * data, const size_t len, const ssize_t size));
+void uring_send(const int fd, const struct sockaddr_in * t_addr, const void * data, const size_t len);
+
+#endif /* URING_H */